@@ -115,6 +115,7 @@ cmd_capture_pane_history(struct args *args, struct cmd_q *cmdq,
 		}
 	} else
 		gd = wp->base.grid;
+	grid_reflow_finish(gd);
 
 	Sflag = args_get(args, 'S');
 	if (Sflag != NULL && strcmp(Sflag, "-") == 0)
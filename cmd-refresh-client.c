@@ -71,6 +71,8 @@ cmd_refresh_client_exec(struct cmd *self, struct cmd_q *cmdq)
 		c->flags |= CLIENT_STATUSFORCE;
 		server_status_client(c);
 	} else {
+		/* The terminal may not show what we think, so draw it all. */
+		tty_invalidate(&c->tty);
 		c->flags |= CLIENT_STATUSFORCE;
 		server_redraw_client(c);
 	}
@@ -97,10 +97,13 @@ cmd_set_option_exec(struct cmd *self, struct cmd_q *cmdq)
 	struct session				*s = cmdq->state.tflag.s;
 	struct winlink				*wl = cmdq->state.tflag.wl;
 	struct window				*w;
+	struct window_pane			*wp;
+	struct grid				*gd;
 	struct client				*c;
 	const struct options_table_entry	*oe;
 	struct options				*oo;
 	const char				*optstr, *valstr, *target;
+	int					 flag;
 
 	/* Get the option name and value. */
 	optstr = args->argv[0];
@@ -191,6 +194,18 @@ cmd_set_option_exec(struct cmd *self, struct cmd_q *cmdq)
 				w->active->flags |= PANE_CHANGED;
 		}
 	}
+	if (strcmp(oe->name, "history-on-disk") == 0) {
+		RB_FOREACH(w, windows, &windows) {
+			flag = options_get_number(w->options, "history-on-disk");
+			TAILQ_FOREACH(wp, &w->panes, entry) {
+				gd = wp->base.grid;
+				if (flag)
+					gd->flags |= GRID_HISTORY_FILE;
+				else
+					gd->flags &= ~GRID_HISTORY_FILE;
+			}
+		}
+	}
 	if (strcmp(oe->name, "key-table") == 0) {
 		TAILQ_FOREACH(c, &clients, entry)
 			server_client_set_key_table(c, NULL);
@@ -200,6 +215,10 @@ cmd_set_option_exec(struct cmd *self, struct cmd_q *cmdq)
 		status_timer_start_all();
 	if (strcmp(oe->name, "monitor-silence") == 0)
 		alerts_reset_all();
+	if (strcmp(oe->name, "default-terminal") == 0) {
+		TAILQ_FOREACH(c, &clients, entry)
+			tty_clear_styles(&c->tty);
+	}
 
 	/* Update sizes and redraw. May not need it but meh. */
 	recalculate_sizes();
@@ -23,6 +23,7 @@
 #include <unistd.h>
 
 #include "tmux.h"
+#include "tmate.h"
 
 /*
  * Show client message log.
@@ -34,8 +35,8 @@ const struct cmd_entry cmd_show_messages_entry = {
 	.name = "show-messages",
 	.alias = "showmsgs",
 
-	.args = { "JTt:", 0, 0 },
-	.usage = "[-JT] " CMD_TARGET_CLIENT_USAGE,
+	.args = { "EGJTt:", 0, 0 },
+	.usage = "[-EGJT] " CMD_TARGET_CLIENT_USAGE,
 
 	.tflag = CMD_CLIENT,
 
@@ -56,6 +57,10 @@ const struct cmd_entry cmd_server_info_entry = {
 
 int	cmd_show_messages_terminals(struct cmd_q *, int);
 int	cmd_show_messages_jobs(struct cmd_q *, int);
+int	cmd_show_messages_grids(struct cmd_q *, int);
+#ifdef TMATE
+int	cmd_show_messages_tmate(struct cmd_q *, int);
+#endif
 
 int
 cmd_show_messages_terminals(struct cmd_q *cmdq, int blank)
@@ -97,6 +102,81 @@ cmd_show_messages_jobs(struct cmd_q *cmdq, int blank)
 	return (n != 0);
 }
 
+int
+cmd_show_messages_grids(struct cmd_q *cmdq, int blank)
+{
+	struct window_pane	*wp;
+	struct grid_arena_stats	 gs;
+	u_int			 n, frag;
+
+	n = 0;
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes) {
+		if (blank) {
+			cmdq_print(cmdq, "%s", "");
+			blank = 0;
+		}
+		grid_arena_stats(wp->base.grid, &gs);
+		frag = 0;
+		if (gs.size != 0)
+			frag = (gs.size - gs.used) * 100 / gs.size;
+		cmdq_print(cmdq, "Pane %%%u: [history=%u, arena=%zu, used=%zu, "
+		    "live=%u, slabs=%u, fragmentation=%u%%]", wp->id,
+		    wp->base.grid->hsize, gs.size, gs.used, gs.live, gs.slabs,
+		    frag);
+		n++;
+	}
+	return (n != 0);
+}
+
+#ifdef TMATE
+int
+cmd_show_messages_tmate(struct cmd_q *cmdq, int blank)
+{
+	struct tmate_encoder		*encoder = &tmate_session.encoder;
+	struct tmate_encoder_stat	*stat;
+	u_int				 n;
+	int				 i;
+
+	n = 0;
+	for (i = 0; i < TMATE_ENCODER_MAX_MSG_TYPES; i++) {
+		stat = &encoder->stats[i];
+		if (stat->msgs == 0)
+			continue;
+		if (blank) {
+			cmdq_print(cmdq, "%s", "");
+			blank = 0;
+		}
+		cmdq_print(cmdq, "Encoder %d: %s [msgs=%llu, bytes=%llu]",
+		    i, tmate_out_msg_name(i), stat->msgs, stat->bytes);
+		n++;
+	}
+
+	if (blank) {
+		cmdq_print(cmdq, "%s", "");
+		blank = 0;
+	}
+	cmdq_print(cmdq, "PTY flushes: [size=%llu, deadline=%llu, echo=%llu, "
+	    "order=%llu, destroy=%llu]",
+	    tmate_session.pty_flushes[TMATE_PTY_FLUSH_SIZE],
+	    tmate_session.pty_flushes[TMATE_PTY_FLUSH_DEADLINE],
+	    tmate_session.pty_flushes[TMATE_PTY_FLUSH_ECHO],
+	    tmate_session.pty_flushes[TMATE_PTY_FLUSH_ORDER],
+	    tmate_session.pty_flushes[TMATE_PTY_FLUSH_DESTROY]);
+	cmdq_print(cmdq, "PTY dropped: [bytes=%llu, panes=%u, recoveries=%llu, "
+	    "backlog=%zu]", tmate_session.pty_dropped_bytes,
+	    tmate_session.dropped_pty_panes, tmate_session.pty_recoveries,
+	    tmate_encoder_backlog(&tmate_session.encoder));
+	cmdq_print(cmdq, "Replay: [msgs=%llu, bytes=%zu, resumes=%llu, "
+	    "resyncs=%llu, resent=%llu]",
+	    (unsigned long long)(tmate_session.encoder.next_seq -
+	    tmate_session.encoder.replay_first_seq),
+	    evbuffer_get_length(tmate_session.encoder.replay),
+	    tmate_session.replay_resumes, tmate_session.replay_resyncs,
+	    tmate_session.replay_bytes);
+	return (1);
+}
+#endif
+
 enum cmd_retval
 cmd_show_messages_exec(struct cmd *self, struct cmd_q *cmdq)
 {
@@ -112,9 +192,19 @@ cmd_show_messages_exec(struct cmd *self, struct cmd_q *cmdq)
 		done = 1;
 	}
 	if (args_has(args, 'J') || self->entry == &cmd_server_info_entry) {
-		cmd_show_messages_jobs(cmdq, blank);
+		blank = cmd_show_messages_jobs(cmdq, blank);
+		done = 1;
+	}
+	if (args_has(args, 'G') || self->entry == &cmd_server_info_entry) {
+		blank = cmd_show_messages_grids(cmdq, blank);
+		done = 1;
+	}
+#ifdef TMATE
+	if (args_has(args, 'E') || self->entry == &cmd_server_info_entry) {
+		cmd_show_messages_tmate(cmdq, blank);
 		done = 1;
 	}
+#endif
 	if (done)
 		return (CMD_RETURN_NORMAL);
 
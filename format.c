@@ -436,21 +436,13 @@ format_cb_history_bytes(struct format_tree *ft, struct format_entry *fe)
 {
 	struct window_pane	*wp = ft->wp;
 	struct grid		*gd;
-	struct grid_line	*gl;
 	unsigned long long	 size;
-	u_int			 i;
 
 	if (wp == NULL)
 		return;
 	gd = wp->base.grid;
 
-	size = 0;
-	for (i = 0; i < gd->hsize; i++) {
-		gl = &gd->linedata[i];
-		size += gl->cellsize * sizeof *gl->celldata;
-		size += gl->extdsize * sizeof *gl->extddata;
-	}
-	size += gd->hsize * sizeof *gd->linedata;
+	size = grid_history_bytes(gd);
 
 	xasprintf(&fe->value, "%llu", size);
 }
@@ -1200,6 +1192,8 @@ format_defaults_pane(struct format_tree *ft, struct window_pane *wp)
 
 	format_add(ft, "pane_tty", "%s", wp->tty);
 	format_add(ft, "pane_pid", "%ld", (long) wp->pid);
+	format_add(ft, "pane_read_size", "%zu", wp->read_size);
+	format_add(ft, "pane_read_rate", "%zu", window_pane_read_rate(wp));
 	format_add_cb(ft, "pane_start_command", format_cb_start_command);
 	format_add_cb(ft, "pane_current_command", format_cb_current_command);
 	format_add_cb(ft, "pane_current_path", format_cb_current_path);
@@ -17,9 +17,13 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 
+#include <errno.h>
+#include <libgen.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "tmux.h"
 
@@ -33,6 +37,23 @@
  * (hsize - 1); from hsize to hsize + (sy - 1) is the viewable data. All
  * functions in this file work on absolute coordinates, grid-view.c has
  * functions which work on the screen data.
+ *
+ * The lines are kept in a circular array of linesize lines, line 0 being at
+ * lineoff, so that lines can be added at the bottom and dropped from the top
+ * without moving the others. grid_get_line gives the line at a position.
+ *
+ * History lines more than a few screens old are packed into compressed blocks
+ * of GRID_BLOCK_LINES lines. grid_get_line uncompresses a line for good, so it
+ * can be changed; grid_peek_line only reads it, through a small cache of
+ * uncompressed blocks.
+ *
+ * Cell arrays come from a per-grid arena of slabs, each holding arrays of one
+ * size class, so growing a line a cell at a time rarely moves it and slabs are
+ * given back once all the lines in them have gone.
+ *
+ * With GRID_HISTORY_FILE, compressed blocks are moved out of memory into a
+ * file next to the server socket, which is mapped for reading. The file is
+ * unlinked as soon as it is created so it goes away with the grid.
  */
 
 /* Default grid cell data. */
@@ -43,10 +64,136 @@ const struct grid_cell_entry grid_default_entry = {
 	0, { .data = { 0, 8, 8, ' ' } }
 };
 
+#define GRID_BLOCK_LINES 64
+#define GRID_HOT_SCREENS 2
+#define GRID_BLOCK_CACHE 8
+
+/*
+ * Compressed block of lines. The cell entries are stored as byte planes (all
+ * the first bytes, then all the second bytes, ...), followed by the extended
+ * cells, and run length encoded.
+ */
+struct grid_block {
+	u_int			 refs;
+
+	u_int			 nlines;
+	u_int			 cells[GRID_BLOCK_LINES];
+	u_int			 extds[GRID_BLOCK_LINES];
+	int			 flags[GRID_BLOCK_LINES];
+	u_int			 ncells;
+	u_int			 nextds;
+
+	u_char			*data;
+	size_t			 size;
+
+	struct grid_file	*file;
+	size_t			 offset;
+	TAILQ_ENTRY(grid_block)	 entry;
+
+	struct grid_block_view	*view;
+};
+
+#define GRID_FILE_MIN (1024 * 1024)
+
+#define GRID_REFLOW_SCREENS 2
+#define GRID_REFLOW_CHUNK 1000
+
+/* Lines of a grid waiting to be reflowed. */
+struct grid_reflow_src {
+	struct grid			*gd;
+	u_int				 py;
+	u_int				 ny;
+
+	TAILQ_ENTRY(grid_reflow_src)	 entry;
+};
+
+/*
+ * Older history waiting to be reflowed into out, a grid with no visible area,
+ * before it is put back above the lines of the owner.
+ */
+struct grid_reflow {
+	struct grid			*owner;
+	u_int				 new_x;
+
+	TAILQ_HEAD(, grid_reflow_src)	 srcs;
+	struct grid			*out;
+
+	TAILQ_ENTRY(grid_reflow)	 entry;
+};
+static TAILQ_HEAD(, grid_reflow) grid_reflows =
+    TAILQ_HEAD_INITIALIZER(grid_reflows);
+static struct event grid_reflow_timer;
+
+/* History file, holding compressed blocks one after another. */
+struct grid_file {
+	int			 fd;
+
+	u_char			*map;
+	size_t			 mapsize;
+
+	size_t			 used;
+	size_t			 live;
+	TAILQ_HEAD(, grid_block) blocks;
+};
+
+/* Uncompressed copy of a block, for reading. */
+struct grid_block_view {
+	struct grid_block		*block;
+
+	struct grid_cell_entry		*celldata;
+	struct grid_cell		*extddata;
+	struct grid_line		 lines[GRID_BLOCK_LINES];
+
+	TAILQ_ENTRY(grid_block_view)	 entry;
+};
+static TAILQ_HEAD(grid_block_views, grid_block_view) grid_block_views =
+    TAILQ_HEAD_INITIALIZER(grid_block_views);
+static u_int grid_block_nviews;
+
+#define GRID_SLAB_SIZE 8192
+#define GRID_SLAB_MIN 64
+#define GRID_SLAB_CLASSES 9 /* 64 to 16384 bytes */
+
+/*
+ * Slab of arrays of the same size. Each array is preceded by a pointer back to
+ * its slab. Arrays too big for any class get a slab of their own.
+ */
+struct grid_slab {
+	struct grid_arena	*arena;
+	int			 class;
+
+	size_t			 objsize;
+	u_int			 nobjs;
+	u_int			 live;
+	u_int			 next;
+	void			*freelist;
+
+	int			 partial;
+	TAILQ_ENTRY(grid_slab)	 entry;
+	TAILQ_ENTRY(grid_slab)	 pentry;
+
+	u_char			*data;
+};
+TAILQ_HEAD(grid_slabs, grid_slab);
+
+struct grid_arena {
+	struct grid_slabs	 slabs;
+	struct grid_slabs	 partial[GRID_SLAB_CLASSES];
+
+	size_t			 size;
+	size_t			 used;
+	u_int			 live;
+	u_int			 nslabs;
+};
+
 int	grid_check_y(struct grid *, u_int);
+void	grid_set_linesize(struct grid *, u_int);
+void	grid_free_line(struct grid *, struct grid_line *);
+static void grid_reflow_free(struct grid_reflow *);
+void	grid_compress_history(struct grid *);
 
-void	grid_reflow_copy(struct grid_line *, u_int, struct grid_line *l,
-	    u_int, u_int);
+void	grid_reflow_copy(struct grid *, struct grid_line *, u_int,
+	    struct grid_line *l, u_int, u_int);
 void	grid_reflow_join(struct grid *, u_int *, struct grid_line *, u_int);
 void	grid_reflow_split(struct grid *, u_int *, struct grid_line *, u_int,
 	    u_int);
@@ -56,11 +203,728 @@ size_t	grid_string_cells_bg(const struct grid_cell *, int *);
 void	grid_string_cells_code(const struct grid_cell *,
 	    const struct grid_cell *, char *, size_t, int);
 
+/* Header before each array in a slab. */
+struct grid_slab_hdr {
+	struct grid_slab	*slab;
+	size_t			 size;
+};
+
+/* Create an empty arena. */
+static struct grid_arena *
+grid_arena_create(void)
+{
+	struct grid_arena	*ga;
+	int			 i;
+
+	ga = xcalloc(1, sizeof *ga);
+	TAILQ_INIT(&ga->slabs);
+	for (i = 0; i < GRID_SLAB_CLASSES; i++)
+		TAILQ_INIT(&ga->partial[i]);
+	return (ga);
+}
+
+/* Add a new slab to an arena. */
+static struct grid_slab *
+grid_slab_create(struct grid_arena *ga, int class, size_t objsize,
+    u_int nobjs)
+{
+	struct grid_slab	*slab;
+
+	slab = xcalloc(1, sizeof *slab);
+	slab->arena = ga;
+	slab->class = class;
+	slab->objsize = objsize;
+	slab->nobjs = nobjs;
+	slab->data = xreallocarray(NULL, nobjs, objsize);
+
+	TAILQ_INSERT_TAIL(&ga->slabs, slab, entry);
+	if (class != -1) {
+		TAILQ_INSERT_HEAD(&ga->partial[class], slab, pentry);
+		slab->partial = 1;
+	}
+	ga->size += sizeof *slab + nobjs * objsize;
+	ga->nslabs++;
+
+	return (slab);
+}
+
+/* Give a slab back to the system. */
+static void
+grid_slab_destroy(struct grid_slab *slab)
+{
+	struct grid_arena	*ga = slab->arena;
+
+	TAILQ_REMOVE(&ga->slabs, slab, entry);
+	if (slab->partial)
+		TAILQ_REMOVE(&ga->partial[slab->class], slab, pentry);
+	ga->size -= sizeof *slab + slab->nobjs * slab->objsize;
+	ga->nslabs--;
+
+	free(slab->data);
+	free(slab);
+}
+
+/* Destroy an arena and any slabs left in it. */
+static void
+grid_arena_destroy(struct grid_arena *ga)
+{
+	struct grid_slab	*slab, *slab1;
+
+	TAILQ_FOREACH_SAFE(slab, &ga->slabs, entry, slab1)
+		grid_slab_destroy(slab);
+	free(ga);
+}
+
+/* Move all the slabs of one arena into another. */
+static void
+grid_arena_merge(struct grid_arena *dst, struct grid_arena *src)
+{
+	struct grid_slab	*slab;
+	int			 i;
+
+	while ((slab = TAILQ_FIRST(&src->slabs)) != NULL) {
+		TAILQ_REMOVE(&src->slabs, slab, entry);
+		TAILQ_INSERT_TAIL(&dst->slabs, slab, entry);
+		slab->arena = dst;
+	}
+	for (i = 0; i < GRID_SLAB_CLASSES; i++) {
+		while ((slab = TAILQ_FIRST(&src->partial[i])) != NULL) {
+			TAILQ_REMOVE(&src->partial[i], slab, pentry);
+			TAILQ_INSERT_TAIL(&dst->partial[i], slab, pentry);
+		}
+	}
+
+	dst->size += src->size;
+	dst->used += src->used;
+	dst->live += src->live;
+	dst->nslabs += src->nslabs;
+	src->size = src->used = 0;
+	src->live = src->nslabs = 0;
+}
+
+/* Allocate an array from the arena of a grid. */
+static void *
+grid_arena_alloc(struct grid *gd, size_t size)
+{
+	struct grid_arena	*ga = gd->arena;
+	struct grid_slab	*slab;
+	struct grid_slab_hdr	*hdr;
+	size_t			 total, objsize;
+	u_int			 nobjs;
+	int			 class;
+
+	total = size + sizeof *hdr;
+	objsize = GRID_SLAB_MIN;
+	for (class = 0; class < GRID_SLAB_CLASSES; class++) {
+		if (total <= objsize)
+			break;
+		objsize <<= 1;
+	}
+
+	if (class == GRID_SLAB_CLASSES)
+		slab = grid_slab_create(ga, -1, total, 1);
+	else {
+		slab = TAILQ_FIRST(&ga->partial[class]);
+		if (slab == NULL) {
+			nobjs = GRID_SLAB_SIZE / objsize;
+			if (nobjs < 2)
+				nobjs = 2;
+			slab = grid_slab_create(ga, class, objsize, nobjs);
+		}
+	}
+
+	if ((hdr = slab->freelist) != NULL)
+		slab->freelist = *(void **)hdr;
+	else
+		hdr = (struct grid_slab_hdr *)(slab->data +
+		    slab->next++ * slab->objsize);
+	if (++slab->live == slab->nobjs && slab->partial) {
+		TAILQ_REMOVE(&ga->partial[slab->class], slab, pentry);
+		slab->partial = 0;
+	}
+
+	hdr->slab = slab;
+	hdr->size = size;
+	ga->used += size;
+	ga->live++;
+	return (hdr + 1);
+}
+
+/* Free an array back to its slab. */
+static void
+grid_arena_free(void *ptr)
+{
+	struct grid_slab_hdr	*hdr;
+	struct grid_slab	*slab;
+	struct grid_arena	*ga;
+	struct grid_slabs	*partial;
+
+	if (ptr == NULL)
+		return;
+	hdr = (struct grid_slab_hdr *)ptr - 1;
+	slab = hdr->slab;
+	ga = slab->arena;
+
+	ga->used -= hdr->size;
+	ga->live--;
+	slab->live--;
+
+	if (slab->class == -1) {
+		grid_slab_destroy(slab);
+		return;
+	}
+
+	*(void **)hdr = slab->freelist;
+	slab->freelist = hdr;
+
+	partial = &ga->partial[slab->class];
+	if (!slab->partial) {
+		TAILQ_INSERT_HEAD(partial, slab, pentry);
+		slab->partial = 1;
+	}
+
+	/* Keep one empty slab for each size, give back the rest. */
+	if (slab->live == 0 && (TAILQ_FIRST(partial) != slab ||
+	    TAILQ_NEXT(slab, pentry) != NULL))
+		grid_slab_destroy(slab);
+}
+
+/* Resize an array, moving it only if it no longer fits in its slot. */
+static void *
+grid_arena_reallocarray(struct grid *gd, void *ptr, size_t nmemb, size_t size)
+{
+	struct grid_slab_hdr	*hdr;
+	void			*new;
+
+	if (nmemb != 0 && SIZE_MAX / nmemb < size)
+		fatalx("grid_arena_reallocarray: nmemb * size > SIZE_MAX");
+	size *= nmemb;
+
+	if (ptr != NULL) {
+		hdr = (struct grid_slab_hdr *)ptr - 1;
+		if (size + sizeof *hdr <= hdr->slab->objsize) {
+			hdr->slab->arena->used += size;
+			hdr->slab->arena->used -= hdr->size;
+			hdr->size = size;
+			return (ptr);
+		}
+	}
+
+	new = grid_arena_alloc(gd, size);
+	if (ptr != NULL) {
+		memcpy(new, ptr, hdr->size);
+		grid_arena_free(ptr);
+	}
+	return (new);
+}
+
+/* Get the statistics for the cell storage of a grid. */
+void
+grid_arena_stats(struct grid *gd, struct grid_arena_stats *gs)
+{
+	gs->size = gd->arena->size;
+	gs->used = gd->arena->used;
+	gs->live = gd->arena->live;
+	gs->slabs = gd->arena->nslabs;
+}
+
+/* Open the history file for a grid. */
+static int
+grid_file_open(struct grid *gd)
+{
+	struct grid_file	*gf;
+	char			*copy, *path;
+	int			 fd;
+
+	copy = xstrdup(socket_path);
+	xasprintf(&path, "%s/history-XXXXXX", dirname(copy));
+	free(copy);
+
+	fd = mkstemp(path);
+	if (fd == -1) {
+		log_debug("%s: %s: %s", __func__, path, strerror(errno));
+		free(path);
+		return (-1);
+	}
+	unlink(path);
+	free(path);
+
+	gf = xcalloc(1, sizeof *gf);
+	gf->fd = fd;
+	TAILQ_INIT(&gf->blocks);
+
+	gd->file = gf;
+	return (0);
+}
+
+/* Close the history file of a grid. */
+static void
+grid_file_close(struct grid *gd)
+{
+	struct grid_file	*gf = gd->file;
+
+	if (gf == NULL)
+		return;
+
+	if (gf->map != NULL)
+		munmap(gf->map, gf->mapsize);
+	close(gf->fd);
+	free(gf);
+
+	gd->file = NULL;
+}
+
+/* Grow the history file and its mapping to fit at least size bytes. */
+static int
+grid_file_grow(struct grid_file *gf, size_t size)
+{
+	u_char	*map;
+	size_t	 mapsize;
+
+	mapsize = gf->mapsize;
+	if (mapsize == 0)
+		mapsize = GRID_FILE_MIN;
+	while (mapsize < size)
+		mapsize *= 2;
+
+	if (ftruncate(gf->fd, mapsize) != 0)
+		return (-1);
+	map = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, gf->fd, 0);
+	if (map == MAP_FAILED)
+		return (-1);
+
+	if (gf->map != NULL)
+		munmap(gf->map, gf->mapsize);
+	gf->map = map;
+	gf->mapsize = mapsize;
+	return (0);
+}
+
+/*
+ * Move the blocks still in use to the start of the file. Blocks are freed
+ * mostly from the oldest, so this is only needed once half the file is unused.
+ */
+static void
+grid_file_compact(struct grid_file *gf)
+{
+	struct grid_block	*gb;
+	size_t			 offset;
+
+	offset = 0;
+	TAILQ_FOREACH(gb, &gf->blocks, entry) {
+		if (gb->offset != offset)
+			memmove(gf->map + offset, gf->map + gb->offset, gb->size);
+		gb->offset = offset;
+		offset += gb->size;
+	}
+	gf->used = offset;
+}
+
+/* Move a compressed block out of memory into the history file. */
+static void
+grid_file_spill(struct grid *gd, struct grid_block *gb)
+{
+	struct grid_file	*gf;
+
+	if (gd->file == NULL && grid_file_open(gd) != 0) {
+		gd->flags &= ~GRID_HISTORY_FILE;
+		return;
+	}
+	gf = gd->file;
+
+	if (gf->used >= GRID_FILE_MIN && gf->used - gf->live > gf->live)
+		grid_file_compact(gf);
+	if (gf->used + gb->size > gf->mapsize &&
+	    grid_file_grow(gf, gf->used + gb->size) != 0) {
+		log_debug("%s: %s", __func__, strerror(errno));
+		return;
+	}
+
+	memcpy(gf->map + gf->used, gb->data, gb->size);
+	gb->file = gf;
+	gb->offset = gf->used;
+	TAILQ_INSERT_TAIL(&gf->blocks, gb, entry);
+	gf->used += gb->size;
+	gf->live += gb->size;
+
+	gd->compressed_size -= gb->size;
+	free(gb->data);
+	gb->data = NULL;
+}
+
+/* Get the compressed data of a block. */
+static u_char *
+grid_block_data(struct grid_block *gb)
+{
+	if (gb->file != NULL)
+		return (gb->file->map + gb->offset);
+	return (gb->data);
+}
+
+/* Get the slot of the line at a position, which may be compressed. */
+static struct grid_line *
+grid_line_slot(struct grid *gd, u_int py)
+{
+	u_int	idx;
+
+	idx = gd->lineoff + py;
+	if (idx >= gd->linesize)
+		idx -= gd->linesize;
+	return (&gd->linedata[idx]);
+}
+
+/* Move the compressed blocks of a range of lines which are not in a file. */
+static void
+grid_file_spill_lines(struct grid *gd, u_int py, u_int ny)
+{
+	struct grid_line	*gl;
+	struct grid_block	*last = NULL;
+	u_int			 yy;
+
+	for (yy = py; yy < py + ny; yy++) {
+		gl = grid_line_slot(gd, yy);
+		if (~gl->flags & GRID_LINE_COMPRESSED || gl->block == last)
+			continue;
+		last = gl->block;
+
+		if (last->file == NULL)
+			grid_file_spill(gd, last);
+		if (~gd->flags & GRID_HISTORY_FILE)
+			break;
+	}
+}
+
+/* Run length encode, dst must have room for len + len / 128 + 1 bytes. */
+static size_t
+grid_rle_encode(const u_char *src, size_t len, u_char *dst)
+{
+	size_t	i, out, run, lit;
+
+	i = out = 0;
+	while (i < len) {
+		run = 1;
+		while (i + run < len && run < 130 && src[i + run] == src[i])
+			run++;
+		if (run >= 3) {
+			dst[out++] = 0x80 | (run - 3);
+			dst[out++] = src[i];
+			i += run;
+			continue;
+		}
+
+		/* Copy literally up to the next run. */
+		lit = 0;
+		while (i + lit < len && lit < 128) {
+			if (i + lit + 2 < len &&
+			    src[i + lit] == src[i + lit + 1] &&
+			    src[i + lit] == src[i + lit + 2])
+				break;
+			lit++;
+		}
+		dst[out++] = lit - 1;
+		memcpy(dst + out, src + i, lit);
+		out += lit;
+		i += lit;
+	}
+	return (out);
+}
+
+/* Run length decode exactly dstlen bytes. */
+static int
+grid_rle_decode(const u_char *src, size_t len, u_char *dst, size_t dstlen)
+{
+	size_t	i, out, n;
+	u_char	c;
+
+	i = out = 0;
+	while (i < len) {
+		c = src[i++];
+		if (c & 0x80) {
+			n = (c & 0x7f) + 3;
+			if (i == len || out + n > dstlen)
+				return (-1);
+			memset(dst + out, src[i++], n);
+		} else {
+			n = c + 1;
+			if (i + n > len || out + n > dstlen)
+				return (-1);
+			memcpy(dst + out, src + i, n);
+			i += n;
+		}
+		out += n;
+	}
+	return (out == dstlen ? 0 : -1);
+}
+
+/* Pack the lines of a block of history starting at py. */
+static void
+grid_compress_block(struct grid *gd, u_int py)
+{
+	struct grid_block	*gb;
+	struct grid_line	*gl;
+	u_char			*raw, *entry;
+	size_t			 rawsize, planesize, off;
+	u_int			 yy, xx, n, cell, i;
+
+	gb = xcalloc(1, sizeof *gb);
+	for (yy = py; yy < py + GRID_BLOCK_LINES; yy++) {
+		gl = grid_line_slot(gd, yy);
+		if (gl->flags & GRID_LINE_COMPRESSED || gl->cellsize == 0)
+			continue;
+		n = gb->nlines++;
+		gb->cells[n] = gl->cellsize;
+		gb->extds[n] = gl->extdsize;
+		gb->flags[n] = gl->flags;
+		gb->ncells += gl->cellsize;
+		gb->nextds += gl->extdsize;
+	}
+	if (gb->nlines == 0) {
+		free(gb);
+		return;
+	}
+
+	planesize = gb->ncells;
+	rawsize = planesize * sizeof *gl->celldata;
+	rawsize += gb->nextds * sizeof *gl->extddata;
+	raw = xmalloc(rawsize);
+
+	cell = 0;
+	off = planesize * sizeof *gl->celldata;
+	n = 0;
+	for (yy = py; yy < py + GRID_BLOCK_LINES; yy++) {
+		gl = grid_line_slot(gd, yy);
+		if (gl->flags & GRID_LINE_COMPRESSED || gl->cellsize == 0)
+			continue;
+
+		for (xx = 0; xx < gl->cellsize; xx++) {
+			entry = (u_char *)&gl->celldata[xx];
+			for (i = 0; i < sizeof *gl->celldata; i++)
+				raw[i * planesize + cell] = entry[i];
+			cell++;
+		}
+		if (gl->extdsize != 0) {
+			memcpy(raw + off, gl->extddata,
+			    gl->extdsize * sizeof *gl->extddata);
+			off += gl->extdsize * sizeof *gl->extddata;
+		}
+
+		grid_arena_free(gl->celldata);
+		grid_arena_free(gl->extddata);
+		gl->celldata = NULL;
+		gl->extddata = NULL;
+		gl->extdsize = 0;
+		gl->flags |= GRID_LINE_COMPRESSED;
+		gl->block = gb;
+		gl->blockline = n++;
+	}
+
+	gb->data = xmalloc(rawsize + rawsize / 128 + 1);
+	gb->size = grid_rle_encode(raw, rawsize, gb->data);
+	gb->data = xrealloc(gb->data, gb->size);
+	free(raw);
+
+	gb->refs = gb->nlines;
+	gd->compressed_size += sizeof *gb + gb->size;
+
+	if (gd->flags & GRID_HISTORY_FILE)
+		grid_file_spill(gd, gb);
+}
+
+/* Compress the history which is old enough. */
+void
+grid_compress_history(struct grid *gd)
+{
+	if (gd->hcompressed > gd->hsize)
+		gd->hcompressed = gd->hsize;
+
+	if (gd->hsize < gd->hcompressed + GRID_BLOCK_LINES +
+	    gd->sy * GRID_HOT_SCREENS)
+		return;
+
+	grid_compress_block(gd, gd->hcompressed);
+	gd->hcompressed += GRID_BLOCK_LINES;
+}
+
+/* Free the uncompressed copy of a block. */
+static void
+grid_free_block_view(struct grid_block_view *view)
+{
+	TAILQ_REMOVE(&grid_block_views, view, entry);
+	grid_block_nviews--;
+
+	view->block->view = NULL;
+	free(view->celldata);
+	free(view->extddata);
+	free(view);
+}
+
+/* Get the uncompressed copy of a block, uncompressing it if needed. */
+static struct grid_block_view *
+grid_get_block_view(struct grid_block *gb)
+{
+	struct grid_block_view	*view;
+	struct grid_line	*gl;
+	u_char			*raw, *entry;
+	size_t			 rawsize, planesize, off;
+	u_int			 n, xx, cell, extd, i;
+
+	if ((view = gb->view) != NULL) {
+		TAILQ_REMOVE(&grid_block_views, view, entry);
+		TAILQ_INSERT_HEAD(&grid_block_views, view, entry);
+		return (view);
+	}
+
+	if (grid_block_nviews == GRID_BLOCK_CACHE)
+		grid_free_block_view(TAILQ_LAST(&grid_block_views,
+		    grid_block_views));
+
+	view = xcalloc(1, sizeof *view);
+	view->block = gb;
+
+	planesize = gb->ncells;
+	rawsize = planesize * sizeof *view->celldata;
+	rawsize += gb->nextds * sizeof *view->extddata;
+	raw = xmalloc(rawsize);
+	if (grid_rle_decode(grid_block_data(gb), gb->size, raw, rawsize) != 0)
+		fatalx("bad compressed history");
+
+	view->celldata = xreallocarray(NULL, gb->ncells,
+	    sizeof *view->celldata);
+	for (cell = 0; cell < gb->ncells; cell++) {
+		entry = (u_char *)&view->celldata[cell];
+		for (i = 0; i < sizeof *view->celldata; i++)
+			entry[i] = raw[i * planesize + cell];
+	}
+	off = planesize * sizeof *view->celldata;
+	if (gb->nextds != 0) {
+		view->extddata = xreallocarray(NULL, gb->nextds,
+		    sizeof *view->extddata);
+		memcpy(view->extddata, raw + off,
+		    gb->nextds * sizeof *view->extddata);
+	}
+	free(raw);
+
+	xx = extd = 0;
+	for (n = 0; n < gb->nlines; n++) {
+		gl = &view->lines[n];
+		gl->cellsize = gb->cells[n];
+		gl->celldata = view->celldata + xx;
+		gl->extdsize = gb->extds[n];
+		if (gl->extdsize != 0)
+			gl->extddata = view->extddata + extd;
+		gl->flags = gb->flags[n] & ~GRID_LINE_COMPRESSED;
+		xx += gb->cells[n];
+		extd += gb->extds[n];
+	}
+
+	gb->view = view;
+	TAILQ_INSERT_HEAD(&grid_block_views, view, entry);
+	grid_block_nviews++;
+	return (view);
+}
+
+/* Drop a reference to a block, freeing it with its last line. */
+static void
+grid_unref_block(struct grid *gd, struct grid_block *gb)
+{
+	if (--gb->refs != 0)
+		return;
+
+	if (gb->view != NULL)
+		grid_free_block_view(gb->view);
+
+	if (gb->file != NULL) {
+		TAILQ_REMOVE(&gb->file->blocks, gb, entry);
+		gb->file->live -= gb->size;
+		if (gb->file->live == 0)
+			gb->file->used = 0;
+		gd->compressed_size -= sizeof *gb;
+	} else {
+		gd->compressed_size -= sizeof *gb + gb->size;
+		free(gb->data);
+	}
+	free(gb);
+}
+
+/* Uncompress a line for good. */
+static void
+grid_uncompress_line(struct grid *gd, struct grid_line *gl)
+{
+	struct grid_block	*gb = gl->block;
+	const struct grid_line	*src;
+
+	src = &grid_get_block_view(gb)->lines[gl->blockline];
+
+	gl->celldata = grid_arena_reallocarray(gd, NULL, src->cellsize,
+	    sizeof *gl->celldata);
+	memcpy(gl->celldata, src->celldata,
+	    src->cellsize * sizeof *gl->celldata);
+	gl->extdsize = src->extdsize;
+	if (src->extdsize != 0) {
+		gl->extddata = grid_arena_reallocarray(gd, NULL, src->extdsize,
+		    sizeof *gl->extddata);
+		memcpy(gl->extddata, src->extddata,
+		    src->extdsize * sizeof *gl->extddata);
+	}
+	gl->flags &= ~GRID_LINE_COMPRESSED;
+	gl->block = NULL;
+	gl->blockline = 0;
+
+	grid_unref_block(gd, gb);
+}
+
+/* Free the data of a line. */
+void
+grid_free_line(struct grid *gd, struct grid_line *gl)
+{
+	if (gl->flags & GRID_LINE_COMPRESSED)
+		grid_unref_block(gd, gl->block);
+	else {
+		grid_arena_free(gl->celldata);
+		grid_arena_free(gl->extddata);
+	}
+	memset(gl, 0, sizeof *gl);
+}
+
+/* Get line at a position, for changing it. */
+struct grid_line *
+grid_get_line(struct grid *gd, u_int py)
+{
+	struct grid_line	*gl;
+
+	gl = grid_line_slot(gd, py);
+	if (gl->flags & GRID_LINE_COMPRESSED)
+		grid_uncompress_line(gd, gl);
+	return (gl);
+}
+
+/* Memory used by the history. */
+unsigned long long
+grid_history_bytes(struct grid *gd)
+{
+	struct grid_line	*gl;
+	unsigned long long	 size;
+	u_int			 yy;
+
+	size = 0;
+	for (yy = 0; yy < gd->hsize; yy++) {
+		gl = grid_line_slot(gd, yy);
+		if (gl->flags & GRID_LINE_COMPRESSED)
+			continue;
+		size += gl->cellsize * sizeof *gl->celldata;
+		size += gl->extdsize * sizeof *gl->extddata;
+	}
+	size += gd->compressed_size;
+	size += gd->linesize * sizeof *gd->linedata;
+
+	return (size);
+}
+
 /* Copy default into a cell. */
 static void
 grid_clear_cell(struct grid *gd, u_int px, u_int py)
 {
-	gd->linedata[py].celldata[px] = grid_default_entry;
+	grid_get_line(gd, py)->celldata[px] = grid_default_entry;
 }
 
 /* Check grid y position. */
@@ -90,6 +954,15 @@ grid_create(u_int sx, u_int sy, u_int hlimit)
 	gd->hlimit = hlimit;
 
 	gd->linedata = xcalloc(gd->sy, sizeof *gd->linedata);
+	gd->linesize = gd->sy;
+	gd->lineoff = 0;
+
+	gd->hcompressed = 0;
+	gd->compressed_size = 0;
+
+	gd->arena = grid_arena_create();
+	gd->file = NULL;
+	gd->reflow = NULL;
 
 	return (gd);
 }
@@ -98,16 +971,17 @@ grid_create(u_int sx, u_int sy, u_int hlimit)
 void
 grid_destroy(struct grid *gd)
 {
-	struct grid_line	*gl;
-	u_int			 yy;
+	u_int	yy;
 
-	for (yy = 0; yy < gd->hsize + gd->sy; yy++) {
-		gl = &gd->linedata[yy];
-		free(gl->celldata);
-		free(gl->extddata);
-	}
+	if (gd->reflow != NULL)
+		grid_reflow_free(gd->reflow);
+
+	for (yy = 0; yy < gd->hsize + gd->sy; yy++)
+		grid_free_line(gd, grid_line_slot(gd, yy));
 
 	free(gd->linedata);
+	grid_arena_destroy(gd->arena);
+	grid_file_close(gd);
 
 	free(gd);
 }
@@ -124,8 +998,8 @@ grid_compare(struct grid *ga, struct grid *gb)
 		return (1);
 
 	for (yy = 0; yy < ga->sy; yy++) {
-		gla = &ga->linedata[yy];
-		glb = &gb->linedata[yy];
+		gla = grid_get_line(ga, yy);
+		glb = grid_get_line(gb, yy);
 		if (gla->cellsize != glb->cellsize)
 			return (1);
 		for (xx = 0; xx < gla->cellsize; xx++) {
@@ -139,9 +1013,54 @@ grid_compare(struct grid *ga, struct grid *gb)
 	return (0);
 }
 
+/*
+ * Resize the line array, keeping the lines in order from the start. Lines
+ * which don't fit must have been cleared.
+ */
+void
+grid_set_linesize(struct grid *gd, u_int linesize)
+{
+	struct grid_line	*linedata;
+	u_int			 yy, ny;
+
+	if (linesize == gd->linesize && gd->lineoff == 0)
+		return;
+
+	linedata = xcalloc(linesize, sizeof *linedata);
+	ny = linesize < gd->linesize ? linesize : gd->linesize;
+	for (yy = 0; yy < ny; yy++)
+		memcpy(&linedata[yy], grid_line_slot(gd, yy), sizeof *linedata);
+
+	free(gd->linedata);
+	gd->linedata = linedata;
+	gd->linesize = linesize;
+	gd->lineoff = 0;
+}
+
+/*
+ * Make room for a number of lines. The array grows geometrically, but not
+ * beyond what the history limit allows.
+ */
+void
+grid_adjust_lines(struct grid *gd, u_int lines)
+{
+	u_int	linesize;
+
+	if (lines <= gd->linesize)
+		return;
+
+	linesize = gd->linesize * 2;
+	if (lines <= gd->hlimit + gd->sy + 1 &&
+	    linesize > gd->hlimit + gd->sy + 1)
+		linesize = gd->hlimit + gd->sy + 1;
+	if (linesize < lines)
+		linesize = lines;
+	grid_set_linesize(gd, linesize);
+}
+
 /*
  * Collect lines from the history if at the limit. Free the top (oldest) 10%
- * and shift up.
+ * and move the start of the grid over them.
  */
 void
 grid_collect_history(struct grid *gd)
@@ -151,17 +1070,22 @@ grid_collect_history(struct grid *gd)
 	if (gd->hsize < gd->hlimit)
 		return;
 
+	/* Anything waiting to be reflowed is older, so must be there first. */
+	grid_reflow_finish(gd);
+
 	yy = gd->hlimit / 10;
 	if (yy < 1)
 		yy = 1;
 
-	grid_move_lines(gd, 0, yy, gd->hsize + gd->sy - yy);
+	grid_clear_lines(gd, 0, yy);
+	gd->lineoff = (gd->lineoff + yy) % gd->linesize;
 	gd->hsize -= yy;
+	gd->hcompressed -= gd->hcompressed < yy ? gd->hcompressed : yy;
 }
 
 /*
  * Scroll the entire visible screen, moving one line into the history. Just
- * allocate a new line at the bottom and move the history size indicator.
+ * add a new line at the bottom and move the history size indicator.
  */
 void
 grid_scroll_history(struct grid *gd)
@@ -169,56 +1093,62 @@ grid_scroll_history(struct grid *gd)
 	u_int	yy;
 
 	yy = gd->hsize + gd->sy;
-	gd->linedata = xreallocarray(gd->linedata, yy + 1,
-	    sizeof *gd->linedata);
-	memset(&gd->linedata[yy], 0, sizeof gd->linedata[yy]);
+	grid_adjust_lines(gd, yy + 1);
+	memset(grid_line_slot(gd, yy), 0, sizeof *gd->linedata);
 
 	gd->hsize++;
+	grid_compress_history(gd);
 }
 
 /* Clear the history. */
 void
 grid_clear_history(struct grid *gd)
 {
+	if (gd->reflow != NULL) {
+		grid_reflow_free(gd->reflow);
+		gd->reflow = NULL;
+	}
+
 	grid_clear_lines(gd, 0, gd->hsize);
-	grid_move_lines(gd, 0, gd->hsize, gd->sy);
+	gd->lineoff = (gd->lineoff + gd->hsize) % gd->linesize;
 
 	gd->hsize = 0;
-	gd->linedata = xreallocarray(gd->linedata, gd->sy,
-	    sizeof *gd->linedata);
+	gd->hcompressed = 0;
+	grid_set_linesize(gd, gd->sy);
 }
 
 /* Scroll a region up, moving the top line into the history. */
 void
 grid_scroll_history_region(struct grid *gd, u_int upper, u_int lower)
 {
-	struct grid_line	*gl_history, *gl_upper, *gl_lower;
+	struct grid_line	 gl_history;
 	u_int			 yy;
 
 	/* Create a space for a new line. */
 	yy = gd->hsize + gd->sy;
-	gd->linedata = xreallocarray(gd->linedata, yy + 1,
-	    sizeof *gd->linedata);
-
-	/* Move the entire screen down to free a space for this line. */
-	gl_history = &gd->linedata[gd->hsize];
-	memmove(gl_history + 1, gl_history, gd->sy * sizeof *gl_history);
-
-	/* Adjust the region and find its start and end. */
-	upper++;
-	gl_upper = &gd->linedata[upper];
-	lower++;
-	gl_lower = &gd->linedata[lower];
-
-	/* Move the line into the history. */
-	memcpy(gl_history, gl_upper, sizeof *gl_history);
-
-	/* Then move the region up and clear the bottom line. */
-	memmove(gl_upper, gl_upper + 1, (lower - upper) * sizeof *gl_upper);
-	memset(gl_lower, 0, sizeof *gl_lower);
+	grid_adjust_lines(gd, yy + 1);
+
+	/*
+	 * The lines in the region keep their position: the history grows
+	 * over the top line of the region. Only the lines above and below
+	 * the region move down, below first to free a line at the bottom of
+	 * the region.
+	 */
+	for (; yy > lower + 1; yy--)
+		memcpy(grid_line_slot(gd, yy), grid_line_slot(gd, yy - 1),
+		    sizeof gl_history);
+	memset(grid_line_slot(gd, lower + 1), 0, sizeof gl_history);
+
+	/* Move the top line into the history. */
+	memcpy(&gl_history, grid_line_slot(gd, upper), sizeof gl_history);
+	for (yy = upper; yy > gd->hsize; yy--)
+		memcpy(grid_line_slot(gd, yy), grid_line_slot(gd, yy - 1),
+		    sizeof gl_history);
+	memcpy(grid_line_slot(gd, gd->hsize), &gl_history, sizeof gl_history);
 
 	/* Move the history offset down over the line. */
 	gd->hsize++;
+	grid_compress_history(gd);
 }
 
 /* Expand line to fit to cell. */
@@ -228,11 +1158,12 @@ grid_expand_line(struct grid *gd, u_int py, u_int sx)
 	struct grid_line	*gl;
 	u_int			 xx;
 
-	gl = &gd->linedata[py];
+	gl = grid_get_line(gd, py);
 	if (sx <= gl->cellsize)
 		return;
 
-	gl->celldata = xreallocarray(gl->celldata, sx, sizeof *gl->celldata);
+	gl->celldata = grid_arena_reallocarray(gd, gl->celldata, sx,
+	    sizeof *gl->celldata);
 	for (xx = gl->cellsize; xx < sx; xx++)
 		grid_clear_cell(gd, xx, py);
 	gl->cellsize = sx;
@@ -242,34 +1173,49 @@ grid_expand_line(struct grid *gd, u_int py, u_int sx)
 const struct grid_line *
 grid_peek_line(struct grid *gd, u_int py)
 {
+	struct grid_line	*gl;
+
 	if (grid_check_y(gd, py) != 0)
 		return (NULL);
-	return (&gd->linedata[py]);
+
+	gl = grid_line_slot(gd, py);
+	if (gl->flags & GRID_LINE_COMPRESSED)
+		return (&grid_get_block_view(gl->block)->lines[gl->blockline]);
+	return (gl);
 }
 
-/* Get cell for reading. */
-void
-grid_get_cell(struct grid *gd, u_int px, u_int py, struct grid_cell *gc)
+/*
+ * Look at a cell of a line without copying it. If the cell is extended (or
+ * past the end of the line), *gcp is set to the full cell. Otherwise *gcp is
+ * NULL and the returned entry has the attributes, colours and a single ASCII
+ * character. The line may be NULL.
+ */
+const struct grid_cell_entry *
+grid_peek_cell(const struct grid_line *gl, u_int px,
+    const struct grid_cell **gcp)
 {
-	struct grid_line	*gl;
-	struct grid_cell_entry	*gce;
+	const struct grid_cell_entry	*gce;
 
-	if (grid_check_y(gd, py) != 0 || px >= gd->linedata[py].cellsize) {
-		memcpy(gc, &grid_default_cell, sizeof *gc);
-		return;
+	if (gl == NULL || px >= gl->cellsize) {
+		*gcp = &grid_default_cell;
+		return (NULL);
 	}
-
-	gl = &gd->linedata[py];
 	gce = &gl->celldata[px];
 
 	if (gce->flags & GRID_FLAG_EXTENDED) {
 		if (gce->offset >= gl->extdsize)
-			memcpy(gc, &grid_default_cell, sizeof *gc);
+			*gcp = &grid_default_cell;
 		else
-			memcpy(gc, &gl->extddata[gce->offset], sizeof *gc);
-		return;
-	}
+			*gcp = &gl->extddata[gce->offset];
+	} else
+		*gcp = NULL;
+	return (gce);
+}
 
+/* Expand a cell entry which is not extended into a full cell. */
+void
+grid_entry_get_cell(const struct grid_cell_entry *gce, struct grid_cell *gc)
+{
 	gc->flags = gce->flags & ~GRID_FLAG_EXTENDED;
 	gc->attr = gce->data.attr;
 	gc->fg = gce->data.fg;
@@ -277,6 +1223,20 @@ grid_get_cell(struct grid *gd, u_int px, u_int py, struct grid_cell *gc)
 	utf8_set(&gc->data, gce->data.data);
 }
 
+/* Get cell for reading. */
+void
+grid_get_cell(struct grid *gd, u_int px, u_int py, struct grid_cell *gc)
+{
+	const struct grid_cell_entry	*gce;
+	const struct grid_cell		*gcp;
+
+	gce = grid_peek_cell(grid_peek_line(gd, py), px, &gcp);
+	if (gcp != NULL)
+		memcpy(gc, gcp, sizeof *gc);
+	else
+		grid_entry_get_cell(gce, gc);
+}
+
 /* Set cell at relative position. */
 void
 grid_set_cell(struct grid *gd, u_int px, u_int py, const struct grid_cell *gc)
@@ -291,7 +1251,7 @@ grid_set_cell(struct grid *gd, u_int px, u_int py, const struct grid_cell *gc)
 
 	grid_expand_line(gd, py, px + 1);
 
-	gl = &gd->linedata[py];
+	gl = grid_get_line(gd, py);
 	gce = &gl->celldata[px];
 
 	extended = (gce->flags & GRID_FLAG_EXTENDED);
@@ -301,7 +1261,7 @@ grid_set_cell(struct grid *gd, u_int px, u_int py, const struct grid_cell *gc)
 		extended = 1;
 	if (extended) {
 		if (~gce->flags & GRID_FLAG_EXTENDED) {
-			gl->extddata = xreallocarray(gl->extddata,
+			gl->extddata = grid_arena_reallocarray(gd, gl->extddata,
 			    gl->extdsize + 1, sizeof *gl->extddata);
 			gce->offset = gl->extdsize++;
 			gce->flags = gc->flags | GRID_FLAG_EXTENDED;
@@ -321,11 +1281,46 @@ grid_set_cell(struct grid *gd, u_int px, u_int py, const struct grid_cell *gc)
 	gce->data.data = gc->data.data[0];
 }
 
+/* Set a run of ASCII cells with the same attributes. */
+void
+grid_set_cells(struct grid *gd, u_int px, u_int py, const struct grid_cell *gc,
+    const u_char *s, u_int slen)
+{
+	struct grid_line	*gl;
+	struct grid_cell_entry	*gce;
+	struct grid_cell	 tmp_gc;
+	u_int			 i;
+
+	if (grid_check_y(gd, py) != 0)
+		return;
+
+	grid_expand_line(gd, py, px + slen);
+
+	gl = grid_get_line(gd, py);
+	for (i = 0; i < slen; i++) {
+		gce = &gl->celldata[px + i];
+		if ((gce->flags & GRID_FLAG_EXTENDED) ||
+		    (gc->flags & (GRID_FLAG_FGRGB|GRID_FLAG_BGRGB))) {
+			memcpy(&tmp_gc, gc, sizeof tmp_gc);
+			utf8_set(&tmp_gc.data, s[i]);
+			grid_set_cell(gd, px + i, py, &tmp_gc);
+			continue;
+		}
+
+		gce->flags = gc->flags & ~GRID_FLAG_EXTENDED;
+		gce->data.attr = gc->attr;
+		gce->data.fg = gc->fg;
+		gce->data.bg = gc->bg;
+		gce->data.data = s[i];
+	}
+}
+
 /* Clear area. */
 void
 grid_clear(struct grid *gd, u_int px, u_int py, u_int nx, u_int ny)
 {
-	u_int	xx, yy;
+	struct grid_line	*gl;
+	u_int			 xx, yy;
 
 	if (nx == 0 || ny == 0)
 		return;
@@ -341,14 +1336,15 @@ grid_clear(struct grid *gd, u_int px, u_int py, u_int nx, u_int ny)
 		return;
 
 	for (yy = py; yy < py + ny; yy++) {
-		if (px >= gd->linedata[yy].cellsize)
+		gl = grid_get_line(gd, yy);
+		if (px >= gl->cellsize)
 			continue;
-		if (px + nx >= gd->linedata[yy].cellsize) {
-			gd->linedata[yy].cellsize = px;
+		if (px + nx >= gl->cellsize) {
+			gl->cellsize = px;
 			continue;
 		}
 		for (xx = px; xx < px + nx; xx++) {
-			if (xx >= gd->linedata[yy].cellsize)
+			if (xx >= gl->cellsize)
 				break;
 			grid_clear_cell(gd, xx, yy);
 		}
@@ -359,8 +1355,7 @@ grid_clear(struct grid *gd, u_int px, u_int py, u_int nx, u_int ny)
 void
 grid_clear_lines(struct grid *gd, u_int py, u_int ny)
 {
-	struct grid_line	*gl;
-	u_int			 yy;
+	u_int	yy;
 
 	if (ny == 0)
 		return;
@@ -370,12 +1365,8 @@ grid_clear_lines(struct grid *gd, u_int py, u_int ny)
 	if (grid_check_y(gd, py + ny - 1) != 0)
 		return;
 
-	for (yy = py; yy < py + ny; yy++) {
-		gl = &gd->linedata[yy];
-		free(gl->celldata);
-		free(gl->extddata);
-		memset(gl, 0, sizeof *gl);
-	}
+	for (yy = py; yy < py + ny; yy++)
+		grid_free_line(gd, grid_line_slot(gd, yy));
 }
 
 /* Move a group of lines. */
@@ -403,14 +1394,24 @@ grid_move_lines(struct grid *gd, u_int dy, u_int py, u_int ny)
 		grid_clear_lines(gd, yy, 1);
 	}
 
-	memmove(&gd->linedata[dy], &gd->linedata[py],
-	    ny * (sizeof *gd->linedata));
+	/* Move the lines, in an order which works if they overlap. */
+	if (dy < py) {
+		for (yy = 0; yy < ny; yy++) {
+			memcpy(grid_line_slot(gd, dy + yy),
+			    grid_line_slot(gd, py + yy), sizeof *gd->linedata);
+		}
+	} else {
+		for (yy = ny; yy > 0; yy--) {
+			memcpy(grid_line_slot(gd, dy + yy - 1),
+			    grid_line_slot(gd, py + yy - 1), sizeof *gd->linedata);
+		}
+	}
 
 	/* Wipe any lines that have been moved (without freeing them). */
 	for (yy = py; yy < py + ny; yy++) {
 		if (yy >= dy && yy < dy + ny)
 			continue;
-		memset(&gd->linedata[yy], 0, sizeof gd->linedata[yy]);
+		memset(grid_line_slot(gd, yy), 0, sizeof *gd->linedata);
 	}
 }
 
@@ -426,7 +1427,7 @@ grid_move_cells(struct grid *gd, u_int dx, u_int px, u_int py, u_int nx)
 
 	if (grid_check_y(gd, py) != 0)
 		return;
-	gl = &gd->linedata[py];
+	gl = grid_get_line(gd, py);
 
 	grid_expand_line(gd, py, px + nx);
 	grid_expand_line(gd, py, dx + nx);
@@ -631,13 +1632,15 @@ char *
 grid_string_cells(struct grid *gd, u_int px, u_int py, u_int nx,
     struct grid_cell **lastgc, int with_codes, int escape_c0, int trim)
 {
-	struct grid_cell	 gc;
-	static struct grid_cell	 lastgc1;
-	const char		*data;
-	char			*buf, code[128];
-	size_t			 len, off, size, codelen;
-	u_int			 xx;
-	const struct grid_line	*gl;
+	struct grid_cell		 gc;
+	const struct grid_cell		*gcp;
+	const struct grid_cell_entry	*gce;
+	static struct grid_cell		 lastgc1;
+	const char			*data;
+	char				*buf, code[128];
+	size_t				 len, off, size, codelen;
+	u_int				 xx;
+	const struct grid_line		*gl;
 
 	if (lastgc != NULL && *lastgc == NULL) {
 		memcpy(&lastgc1, &grid_default_cell, sizeof lastgc1);
@@ -652,20 +1655,33 @@ grid_string_cells(struct grid *gd, u_int px, u_int py, u_int nx,
 	for (xx = px; xx < px + nx; xx++) {
 		if (gl == NULL || xx >= gl->cellsize)
 			break;
-		grid_get_cell(gd, xx, py, &gc);
-		if (gc.flags & GRID_FLAG_PADDING)
-			continue;
+
+		/* Only expand cells which aren't extended if needed. */
+		gce = grid_peek_cell(gl, xx, &gcp);
+		if (gcp == NULL) {
+			if (gce->flags & GRID_FLAG_PADDING)
+				continue;
+			if (with_codes) {
+				grid_entry_get_cell(gce, &gc);
+				gcp = &gc;
+			}
+			data = (const char *)&gce->data.data;
+			size = 1;
+		} else {
+			if (gcp->flags & GRID_FLAG_PADDING)
+				continue;
+			data = gcp->data.data;
+			size = gcp->data.size;
+		}
 
 		if (with_codes) {
-			grid_string_cells_code(*lastgc, &gc, code, sizeof code,
+			grid_string_cells_code(*lastgc, gcp, code, sizeof code,
 			    escape_c0);
 			codelen = strlen(code);
-			memcpy(*lastgc, &gc, sizeof **lastgc);
+			memcpy(*lastgc, gcp, sizeof **lastgc);
 		} else
 			codelen = 0;
 
-		data = gc.data.data;
-		size = gc.data.size;
 		if (escape_c0 && size == 1 && *data == '\\') {
 			data = "\\\\";
 			size = 2;
@@ -702,7 +1718,8 @@ void
 grid_duplicate_lines(struct grid *dst, u_int dy, struct grid *src, u_int sy,
     u_int ny)
 {
-	struct grid_line	*dstl, *srcl;
+	const struct grid_line	*srcl;
+	struct grid_line	*dstl;
 	u_int			 yy;
 
 	if (dy + ny > dst->hsize + dst->sy)
@@ -712,12 +1729,12 @@ grid_duplicate_lines(struct grid *dst, u_int dy, struct grid *src, u_int sy,
 	grid_clear_lines(dst, dy, ny);
 
 	for (yy = 0; yy < ny; yy++) {
-		srcl = &src->linedata[sy];
-		dstl = &dst->linedata[dy];
+		srcl = grid_peek_line(src, sy);
+		dstl = grid_get_line(dst, dy);
 
 		memcpy(dstl, srcl, sizeof *dstl);
 		if (srcl->cellsize != 0) {
-			dstl->celldata = xreallocarray(NULL,
+			dstl->celldata = grid_arena_reallocarray(dst, NULL,
 			    srcl->cellsize, sizeof *dstl->celldata);
 			memcpy(dstl->celldata, srcl->celldata,
 			    srcl->cellsize * sizeof *dstl->celldata);
@@ -726,8 +1743,8 @@ grid_duplicate_lines(struct grid *dst, u_int dy, struct grid *src, u_int sy,
 
 		if (srcl->extdsize != 0) {
 			dstl->extdsize = srcl->extdsize;
-			dstl->extddata = xreallocarray(NULL, dstl->extdsize,
-			    sizeof *dstl->extddata);
+			dstl->extddata = grid_arena_reallocarray(dst, NULL,
+			    dstl->extdsize, sizeof *dstl->extddata);
 			memcpy(dstl->extddata, srcl->extddata, dstl->extdsize *
 			    sizeof *dstl->extddata);
 		}
@@ -737,10 +1754,36 @@ grid_duplicate_lines(struct grid *dst, u_int dy, struct grid *src, u_int sy,
 	}
 }
 
+/*
+ * Swap a set of lines between two grids without copying their cells. The cell
+ * data stays in the arena it was allocated from, so lines swapped into a grid
+ * must be swapped back or the grid destroyed before the other grid is.
+ */
+void
+grid_swap_lines(struct grid *ga, u_int pa, struct grid *gb, u_int pb, u_int ny)
+{
+	struct grid_line	 gl, *gla, *glb;
+	u_int			 yy;
+
+	if (pa + ny > ga->hsize + ga->sy)
+		ny = ga->hsize + ga->sy - pa;
+	if (pb + ny > gb->hsize + gb->sy)
+		ny = gb->hsize + gb->sy - pb;
+
+	for (yy = 0; yy < ny; yy++) {
+		gla = grid_get_line(ga, pa + yy);
+		glb = grid_get_line(gb, pb + yy);
+
+		memcpy(&gl, gla, sizeof gl);
+		memcpy(gla, glb, sizeof *gla);
+		memcpy(glb, &gl, sizeof *glb);
+	}
+}
+
 /* Copy a section of a line. */
 void
-grid_reflow_copy(struct grid_line *dst_gl, u_int to, struct grid_line *src_gl,
-    u_int from, u_int to_copy)
+grid_reflow_copy(struct grid *dst, struct grid_line *dst_gl, u_int to,
+    struct grid_line *src_gl, u_int from, u_int to_copy)
 {
 	struct grid_cell_entry	*gce;
 	u_int			 i, was;
@@ -754,7 +1797,7 @@ grid_reflow_copy(struct grid_line *dst_gl, u_int to, struct grid_line *src_gl,
 			continue;
 		was = gce->offset;
 
-		dst_gl->extddata = xreallocarray(dst_gl->extddata,
+		dst_gl->extddata = grid_arena_reallocarray(dst, dst_gl->extddata,
 		    dst_gl->extdsize + 1, sizeof *dst_gl->extddata);
 		gce->offset = dst_gl->extdsize++;
 		memcpy(&dst_gl->extddata[gce->offset], &src_gl->extddata[was],
@@ -767,7 +1810,7 @@ void
 grid_reflow_join(struct grid *dst, u_int *py, struct grid_line *src_gl,
     u_int new_x)
 {
-	struct grid_line	*dst_gl = &dst->linedata[(*py) - 1];
+	struct grid_line	*dst_gl = grid_get_line(dst, (*py) - 1);
 	u_int			 left, to_copy, ox, nx;
 
 	/* How much is left on the old line? */
@@ -781,12 +1824,12 @@ grid_reflow_join(struct grid *dst, u_int *py, struct grid_line *src_gl,
 	nx = ox + to_copy;
 
 	/* Resize the destination line. */
-	dst_gl->celldata = xreallocarray(dst_gl->celldata, nx,
+	dst_gl->celldata = grid_arena_reallocarray(dst, dst_gl->celldata, nx,
 	    sizeof *dst_gl->celldata);
 	dst_gl->cellsize = nx;
 
 	/* Append as much as possible. */
-	grid_reflow_copy(dst_gl, ox, src_gl, 0, to_copy);
+	grid_reflow_copy(dst, dst_gl, ox, src_gl, 0, to_copy);
 
 	/* If there is any left in the source, split it. */
 	if (src_gl->cellsize > to_copy) {
@@ -810,7 +1853,7 @@ grid_reflow_split(struct grid *dst, u_int *py, struct grid_line *src_gl,
 		/* Create new line. */
 		if (*py >= dst->hsize + dst->sy)
 			grid_scroll_history(dst);
-		dst_gl = &dst->linedata[*py];
+		dst_gl = grid_get_line(dst, *py);
 		(*py)++;
 
 		/* How much should we copy? */
@@ -819,13 +1862,13 @@ grid_reflow_split(struct grid *dst, u_int *py, struct grid_line *src_gl,
 			to_copy = src_gl->cellsize;
 
 		/* Expand destination line. */
-		dst_gl->celldata = xreallocarray(NULL, to_copy,
+		dst_gl->celldata = grid_arena_reallocarray(dst, NULL, to_copy,
 		    sizeof *dst_gl->celldata);
 		dst_gl->cellsize = to_copy;
 		dst_gl->flags |= GRID_LINE_WRAPPED;
 
 		/* Copy the data. */
-		grid_reflow_copy(dst_gl, 0, src_gl, offset, to_copy);
+		grid_reflow_copy(dst, dst_gl, 0, src_gl, offset, to_copy);
 
 		/* Move offset and reduce old line size. */
 		offset += to_copy;
@@ -846,7 +1889,7 @@ grid_reflow_move(struct grid *dst, u_int *py, struct grid_line *src_gl)
 	/* Create new line. */
 	if (*py >= dst->hsize + dst->sy)
 		grid_scroll_history(dst);
-	dst_gl = &dst->linedata[*py];
+	dst_gl = grid_get_line(dst, *py);
 	(*py)++;
 
 	/* Copy the old line. */
@@ -858,39 +1901,311 @@ grid_reflow_move(struct grid *dst, u_int *py, struct grid_line *src_gl)
 	src_gl->extddata = NULL;
 }
 
-/*
- * Reflow lines from src grid into dst grid of width new_x. Returns number of
- * lines fewer in the visible area. The source grid is destroyed.
- */
-u_int
-grid_reflow(struct grid *dst, struct grid *src, u_int new_x)
+/* Reflow a range of lines from src onto the end of dst. */
+static void
+grid_reflow_lines(struct grid *dst, u_int *py, struct grid *src, u_int first,
+    u_int last, u_int new_x)
 {
-	u_int			 py, sy, line;
+	u_int			 line;
 	int			 previous_wrapped;
 	struct grid_line	*src_gl;
 
-	py = 0;
-	sy = src->sy;
-
 	previous_wrapped = 0;
-	for (line = 0; line < sy + src->hsize; line++) {
-		src_gl = src->linedata + line;
+	for (line = first; line < last; line++) {
+		src_gl = grid_get_line(src, line);
 		if (!previous_wrapped) {
 			/* Wasn't wrapped. If smaller, move to destination. */
 			if (src_gl->cellsize <= new_x)
-				grid_reflow_move(dst, &py, src_gl);
+				grid_reflow_move(dst, py, src_gl);
 			else
-				grid_reflow_split(dst, &py, src_gl, new_x, 0);
+				grid_reflow_split(dst, py, src_gl, new_x, 0);
 		} else {
 			/* Previous was wrapped. Try to join. */
-			grid_reflow_join(dst, &py, src_gl, new_x);
+			grid_reflow_join(dst, py, src_gl, new_x);
 		}
 		previous_wrapped = (src_gl->flags & GRID_LINE_WRAPPED);
 	}
+}
+
+/*
+ * Find the first line to reflow straight away: the start of a logical line,
+ * with roughly enough lines after it to give want lines at the new width.
+ */
+static u_int
+grid_reflow_cut(struct grid *src, u_int new_x, u_int want)
+{
+	const struct grid_line	*gl;
+	u_int			 line, lines, cells;
+
+	lines = cells = 0;
+	for (line = src->hsize + src->sy; line > 0; line--) {
+		cells += grid_peek_line(src, line - 1)->cellsize;
+		if (line > 1) {
+			gl = grid_peek_line(src, line - 2);
+			if (gl->flags & GRID_LINE_WRAPPED)
+				continue;
+		}
+
+		lines += cells / new_x + 1;
+		if (lines >= want)
+			return (line - 1);
+		cells = 0;
+	}
+	return (0);
+}
+
+/* Create a grid for reflowed lines: all history with no visible area. */
+static struct grid *
+grid_reflow_create_out(u_int new_x)
+{
+	struct grid	*out;
+
+	out = grid_create(new_x, 1, UINT_MAX);
+	out->sy = 0;
+	return (out);
+}
+
+/* Reflow state starting with an empty output grid. */
+static struct grid_reflow *
+grid_reflow_create(u_int new_x)
+{
+	struct grid_reflow	*gr;
+
+	gr = xcalloc(1, sizeof *gr);
+	TAILQ_INIT(&gr->srcs);
+	gr->out = grid_reflow_create_out(new_x);
+	return (gr);
+}
+
+/* Add lines still to be reflowed to the end (or the start) of the queue. */
+static void
+grid_reflow_add(struct grid_reflow *gr, struct grid *gd, u_int ny, int head)
+{
+	struct grid_reflow_src	*rs;
+
+	rs = xcalloc(1, sizeof *rs);
+	rs->gd = gd;
+	rs->py = 0;
+	rs->ny = ny;
+	if (head)
+		TAILQ_INSERT_HEAD(&gr->srcs, rs, entry);
+	else
+		TAILQ_INSERT_TAIL(&gr->srcs, rs, entry);
+}
+
+/* Free reflow state and the lines left in it. */
+static void
+grid_reflow_free(struct grid_reflow *gr)
+{
+	struct grid_reflow_src	*rs, *rs1;
+
+	if (gr->owner != NULL)
+		TAILQ_REMOVE(&grid_reflows, gr, entry);
+
+	TAILQ_FOREACH_SAFE(rs, &gr->srcs, entry, rs1) {
+		grid_destroy(rs->gd);
+		free(rs);
+	}
+	grid_destroy(gr->out);
+	free(gr);
+}
 
-	grid_destroy(src);
+/*
+ * Reflow about the given number of lines from the queue, stopping at the end
+ * of a logical line. Returns 1 when the queue is empty.
+ */
+static int
+grid_reflow_step(struct grid_reflow *gr, u_int lines)
+{
+	struct grid_reflow_src	*rs;
+	struct grid		*out = gr->out;
+	u_int			 py, end;
+
+	py = out->hsize;
+	while (lines != 0 && (rs = TAILQ_FIRST(&gr->srcs)) != NULL) {
+		if (lines > rs->ny - rs->py)
+			end = rs->ny;
+		else
+			end = rs->py + lines;
+		while (end < rs->ny &&
+		    grid_peek_line(rs->gd, end - 1)->flags & GRID_LINE_WRAPPED)
+			end++;
+		lines -= (end - rs->py > lines) ? lines : end - rs->py;
+
+		grid_reflow_lines(out, &py, rs->gd, rs->py, end, gr->new_x);
+		rs->py = end;
+
+		if (rs->py == rs->ny) {
+			TAILQ_REMOVE(&gr->srcs, rs, entry);
+			grid_arena_merge(out->arena, rs->gd->arena);
+			grid_destroy(rs->gd);
+			free(rs);
+		}
+	}
+	return (TAILQ_EMPTY(&gr->srcs));
+}
 
-	if (py > sy)
-		return (0);
-	return (sy - py);
+/*
+ * Put the reflowed lines above the first keep lines of the grid, dropping the
+ * rest (which must be empty), and free the reflow state.
+ */
+static void
+grid_reflow_splice(struct grid *gd, u_int keep)
+{
+	struct grid_reflow	*gr = gd->reflow;
+	struct grid		*out = gr->out;
+	struct grid_line	*linedata;
+	u_int			 n, total, yy;
+
+	n = out->hsize;
+	total = n + keep;
+	if (total < gd->sy)
+		total = gd->sy;
+
+	linedata = xcalloc(total, sizeof *linedata);
+	for (yy = 0; yy < n; yy++)
+		memcpy(&linedata[yy], grid_line_slot(out, yy), sizeof *linedata);
+	for (yy = 0; yy < keep; yy++) {
+		memcpy(&linedata[n + yy], grid_line_slot(gd, yy),
+		    sizeof *linedata);
+	}
+	for (yy = keep; yy < gd->hsize + gd->sy; yy++)
+		grid_free_line(gd, grid_line_slot(gd, yy));
+
+	free(gd->linedata);
+	gd->linedata = linedata;
+	gd->linesize = total;
+	gd->lineoff = 0;
+	gd->hsize = total - gd->sy;
+
+	/* Take over the lines of the output grid and throw the rest away. */
+	gd->compressed_size += out->compressed_size;
+	grid_arena_merge(gd->arena, out->arena);
+	memset(out->linedata, 0, out->linesize * sizeof *out->linedata);
+	out->hsize = 0;
+
+	/*
+	 * The output grid has no file, so move its blocks into ours. Then
+	 * compress from where it stopped, which skips over any of our own lines
+	 * that were already compressed.
+	 */
+	if (gd->flags & GRID_HISTORY_FILE)
+		grid_file_spill_lines(gd, 0, out->hcompressed);
+	gd->hcompressed = out->hcompressed;
+	do {
+		yy = gd->hcompressed;
+		grid_compress_history(gd);
+	} while (gd->hcompressed != yy);
+
+	gd->reflow = NULL;
+	grid_reflow_free(gr);
+}
+
+/* Reflow some waiting history when the server is idle. */
+static void
+grid_reflow_callback(__unused int fd, __unused short events,
+    __unused void *arg)
+{
+	struct grid_reflow	*gr;
+	struct grid		*gd;
+	struct timeval		 tv = { 0, 0 };
+
+	if ((gr = TAILQ_FIRST(&grid_reflows)) == NULL)
+		return;
+	gd = gr->owner;
+
+	if (grid_reflow_step(gr, GRID_REFLOW_CHUNK))
+		grid_reflow_splice(gd, gd->hsize + gd->sy);
+	else {
+		TAILQ_REMOVE(&grid_reflows, gr, entry);
+		TAILQ_INSERT_TAIL(&grid_reflows, gr, entry);
+	}
+
+	if (!TAILQ_EMPTY(&grid_reflows))
+		evtimer_add(&grid_reflow_timer, &tv);
+}
+
+/* Finish reflowing the history of a grid now. */
+void
+grid_reflow_finish(struct grid *gd)
+{
+	struct grid_reflow	*gr = gd->reflow;
+
+	if (gr == NULL)
+		return;
+	while (!grid_reflow_step(gr, UINT_MAX))
+		/* nothing */;
+	grid_reflow_splice(gd, gd->hsize + gd->sy);
+}
+
+/*
+ * Reflow lines from src grid into dst grid of width new_x. Returns number of
+ * lines fewer in the visible area. The source grid is destroyed.
+ *
+ * Only the lines needed for the visible area and a screen above it are done
+ * here. Older history is queued and reflowed in chunks when idle, or all at
+ * once by grid_reflow_finish when something needs it. If src still had
+ * history waiting from an earlier reflow, it is carried over and reflowed
+ * once, to the final width.
+ */
+u_int
+grid_reflow(struct grid *dst, struct grid *src, u_int new_x)
+{
+	struct grid_reflow	*gr;
+	struct timeval		 tv = { 0, 0 };
+	u_int			 py, sy, first, n;
+
+	sy = src->sy;
+	first = grid_reflow_cut(src, new_x, sy * GRID_REFLOW_SCREENS);
+	if (first < GRID_REFLOW_CHUNK)
+		first = 0;
+
+	py = 0;
+	grid_reflow_lines(dst, &py, src, first, src->hsize + sy, new_x);
+
+	/* Lines moved across still live in the old arena. */
+	grid_arena_merge(dst->arena, src->arena);
+
+	if ((gr = src->reflow) == NULL && first == 0) {
+		grid_destroy(src);
+		if (py > sy)
+			return (0);
+		return (sy - py);
+	}
+	src->reflow = NULL;
+
+	if (gr == NULL)
+		gr = grid_reflow_create(new_x);
+	else {
+		/* Lines done at the old width are reflowed again first. */
+		grid_reflow_add(gr, gr->out, gr->out->hsize, 1);
+		gr->out = grid_reflow_create_out(new_x);
+	}
+	if (first != 0) {
+		grid_clear_lines(src, first, src->hsize + sy - first);
+		grid_reflow_add(gr, src, first, 0);
+	} else
+		grid_destroy(src);
+	gr->new_x = new_x;
+	dst->reflow = gr;
+
+	/* If the visible area isn't full, do the rest now. */
+	if (py < sy) {
+		while (!grid_reflow_step(gr, UINT_MAX))
+			/* nothing */;
+		n = gr->out->hsize;
+		grid_reflow_splice(dst, py);
+		py += n;
+		if (py > sy)
+			return (0);
+		return (sy - py);
+	}
+
+	if (gr->owner == NULL)
+		TAILQ_INSERT_TAIL(&grid_reflows, gr, entry);
+	gr->owner = dst;
+	if (!event_initialized(&grid_reflow_timer))
+		evtimer_set(&grid_reflow_timer, grid_reflow_callback, NULL);
+	evtimer_add(&grid_reflow_timer, &tv);
+	return (0);
 }
@@ -102,6 +102,8 @@ int	input_split(struct input_ctx *);
 int	input_get(struct input_ctx *, u_int, int, int);
 void printflike(2, 3) input_reply(struct input_ctx *, const char *, ...);
 void	input_set_state(struct window_pane *, const struct input_transition *);
+void	input_build_dispatch(void);
+void	input_print_run(struct input_ctx *, const u_char *, u_int);
 void	input_reset_cell(struct input_ctx *);
 
 /* Transition entry/exit handlers. */
@@ -261,12 +263,16 @@ struct input_transition {
 	const struct input_state       *state;
 };
 
-/* Input state. */
+/*
+ * Input state. The dispatch table gives the transition for each byte. It
+ * is built from the transitions table when the first pane is created.
+ */
 struct input_state {
 	const char			*name;
 	void				(*enter)(struct input_ctx *);
 	void				(*exit)(struct input_ctx *);
 	const struct input_transition	*transitions;
+	const struct input_transition	**dispatch;
 };
 
 /* State transitions available from all states. */
@@ -297,144 +303,211 @@ const struct input_transition input_state_utf8_three_table[];
 const struct input_transition input_state_utf8_two_table[];
 const struct input_transition input_state_utf8_one_table[];
 
+/* Dispatch tables, built by input_build_dispatch. */
+const struct input_transition *input_state_ground_dispatch[256];
+const struct input_transition *input_state_esc_enter_dispatch[256];
+const struct input_transition *input_state_esc_intermediate_dispatch[256];
+const struct input_transition *input_state_csi_enter_dispatch[256];
+const struct input_transition *input_state_csi_parameter_dispatch[256];
+const struct input_transition *input_state_csi_intermediate_dispatch[256];
+const struct input_transition *input_state_csi_ignore_dispatch[256];
+const struct input_transition *input_state_dcs_enter_dispatch[256];
+const struct input_transition *input_state_dcs_parameter_dispatch[256];
+const struct input_transition *input_state_dcs_intermediate_dispatch[256];
+const struct input_transition *input_state_dcs_handler_dispatch[256];
+const struct input_transition *input_state_dcs_escape_dispatch[256];
+const struct input_transition *input_state_dcs_ignore_dispatch[256];
+const struct input_transition *input_state_osc_string_dispatch[256];
+const struct input_transition *input_state_apc_string_dispatch[256];
+const struct input_transition *input_state_rename_string_dispatch[256];
+const struct input_transition *input_state_consume_st_dispatch[256];
+const struct input_transition *input_state_utf8_three_dispatch[256];
+const struct input_transition *input_state_utf8_two_dispatch[256];
+const struct input_transition *input_state_utf8_one_dispatch[256];
+
 /* ground state definition. */
 const struct input_state input_state_ground = {
 	"ground",
 	input_ground, NULL,
-	input_state_ground_table
+	input_state_ground_table,
+	input_state_ground_dispatch
 };
 
 /* esc_enter state definition. */
 const struct input_state input_state_esc_enter = {
 	"esc_enter",
 	input_clear, NULL,
-	input_state_esc_enter_table
+	input_state_esc_enter_table,
+	input_state_esc_enter_dispatch
 };
 
 /* esc_intermediate state definition. */
 const struct input_state input_state_esc_intermediate = {
 	"esc_intermediate",
 	NULL, NULL,
-	input_state_esc_intermediate_table
+	input_state_esc_intermediate_table,
+	input_state_esc_intermediate_dispatch
 };
 
 /* csi_enter state definition. */
 const struct input_state input_state_csi_enter = {
 	"csi_enter",
 	input_clear, NULL,
-	input_state_csi_enter_table
+	input_state_csi_enter_table,
+	input_state_csi_enter_dispatch
 };
 
 /* csi_parameter state definition. */
 const struct input_state input_state_csi_parameter = {
 	"csi_parameter",
 	NULL, NULL,
-	input_state_csi_parameter_table
+	input_state_csi_parameter_table,
+	input_state_csi_parameter_dispatch
 };
 
 /* csi_intermediate state definition. */
 const struct input_state input_state_csi_intermediate = {
 	"csi_intermediate",
 	NULL, NULL,
-	input_state_csi_intermediate_table
+	input_state_csi_intermediate_table,
+	input_state_csi_intermediate_dispatch
 };
 
 /* csi_ignore state definition. */
 const struct input_state input_state_csi_ignore = {
 	"csi_ignore",
 	NULL, NULL,
-	input_state_csi_ignore_table
+	input_state_csi_ignore_table,
+	input_state_csi_ignore_dispatch
 };
 
 /* dcs_enter state definition. */
 const struct input_state input_state_dcs_enter = {
 	"dcs_enter",
 	input_clear, NULL,
-	input_state_dcs_enter_table
+	input_state_dcs_enter_table,
+	input_state_dcs_enter_dispatch
 };
 
 /* dcs_parameter state definition. */
 const struct input_state input_state_dcs_parameter = {
 	"dcs_parameter",
 	NULL, NULL,
-	input_state_dcs_parameter_table
+	input_state_dcs_parameter_table,
+	input_state_dcs_parameter_dispatch
 };
 
 /* dcs_intermediate state definition. */
 const struct input_state input_state_dcs_intermediate = {
 	"dcs_intermediate",
 	NULL, NULL,
-	input_state_dcs_intermediate_table
+	input_state_dcs_intermediate_table,
+	input_state_dcs_intermediate_dispatch
 };
 
 /* dcs_handler state definition. */
 const struct input_state input_state_dcs_handler = {
 	"dcs_handler",
 	NULL, NULL,
-	input_state_dcs_handler_table
+	input_state_dcs_handler_table,
+	input_state_dcs_handler_dispatch
 };
 
 /* dcs_escape state definition. */
 const struct input_state input_state_dcs_escape = {
 	"dcs_escape",
 	NULL, NULL,
-	input_state_dcs_escape_table
+	input_state_dcs_escape_table,
+	input_state_dcs_escape_dispatch
 };
 
 /* dcs_ignore state definition. */
 const struct input_state input_state_dcs_ignore = {
 	"dcs_ignore",
 	NULL, NULL,
-	input_state_dcs_ignore_table
+	input_state_dcs_ignore_table,
+	input_state_dcs_ignore_dispatch
 };
 
 /* osc_string state definition. */
 const struct input_state input_state_osc_string = {
 	"osc_string",
 	input_enter_osc, input_exit_osc,
-	input_state_osc_string_table
+	input_state_osc_string_table,
+	input_state_osc_string_dispatch
 };
 
 /* apc_string state definition. */
 const struct input_state input_state_apc_string = {
 	"apc_string",
 	input_enter_apc, input_exit_apc,
-	input_state_apc_string_table
+	input_state_apc_string_table,
+	input_state_apc_string_dispatch
 };
 
 /* rename_string state definition. */
 const struct input_state input_state_rename_string = {
 	"rename_string",
 	input_enter_rename, input_exit_rename,
-	input_state_rename_string_table
+	input_state_rename_string_table,
+	input_state_rename_string_dispatch
 };
 
 /* consume_st state definition. */
 const struct input_state input_state_consume_st = {
 	"consume_st",
 	NULL, NULL,
-	input_state_consume_st_table
+	input_state_consume_st_table,
+	input_state_consume_st_dispatch
 };
 
 /* utf8_three state definition. */
 const struct input_state input_state_utf8_three = {
 	"utf8_three",
 	NULL, NULL,
-	input_state_utf8_three_table
+	input_state_utf8_three_table,
+	input_state_utf8_three_dispatch
 };
 
 /* utf8_two state definition. */
 const struct input_state input_state_utf8_two = {
 	"utf8_two",
 	NULL, NULL,
-	input_state_utf8_two_table
+	input_state_utf8_two_table,
+	input_state_utf8_two_dispatch
 };
 
 /* utf8_one state definition. */
 const struct input_state input_state_utf8_one = {
 	"utf8_one",
 	NULL, NULL,
-	input_state_utf8_one_table
+	input_state_utf8_one_table,
+	input_state_utf8_one_dispatch
+};
+
+/* All states, to build the dispatch tables. */
+const struct input_state *input_states[] = {
+	&input_state_ground,
+	&input_state_esc_enter,
+	&input_state_esc_intermediate,
+	&input_state_csi_enter,
+	&input_state_csi_parameter,
+	&input_state_csi_intermediate,
+	&input_state_csi_ignore,
+	&input_state_dcs_enter,
+	&input_state_dcs_parameter,
+	&input_state_dcs_intermediate,
+	&input_state_dcs_handler,
+	&input_state_dcs_escape,
+	&input_state_dcs_ignore,
+	&input_state_osc_string,
+	&input_state_apc_string,
+	&input_state_rename_string,
+	&input_state_consume_st,
+	&input_state_utf8_three,
+	&input_state_utf8_two,
+	&input_state_utf8_one,
+	NULL
 };
 
 /* ground state table. */
@@ -767,6 +840,7 @@ input_init(struct window_pane *wp)
 
 	ictx->since_ground = evbuffer_new();
 
+	input_build_dispatch();
 	input_reset(wp, 0);
 }
 
@@ -833,6 +907,33 @@ input_set_state(struct window_pane *wp, const struct input_transition *itr)
 		ictx->state->enter(ictx);
 }
 
+/* Build the dispatch tables, the first transition matching a byte wins. */
+void
+input_build_dispatch(void)
+{
+	static int			 built;
+	const struct input_state	**state;
+	const struct input_transition	*itr;
+	int				 ch;
+
+	if (built)
+		return;
+	built = 1;
+
+	for (state = input_states; *state != NULL; state++) {
+		for (ch = 0; ch < 256; ch++) {
+			itr = (*state)->transitions;
+			while (itr->first != -1 && itr->last != -1) {
+				if (ch >= itr->first && ch <= itr->last)
+					break;
+				itr++;
+			}
+			if (itr->first != -1 && itr->last != -1)
+				(*state)->dispatch[ch] = itr;
+		}
+	}
+}
+
 /* Parse input. */
 void
 input_parse(struct window_pane *wp)
@@ -841,7 +942,7 @@ input_parse(struct window_pane *wp)
 	const struct input_transition	*itr;
 	struct evbuffer			*evb = wp->event->input;
 	u_char				*buf;
-	size_t				 len, off;
+	size_t				 len, off, end;
 
 	if (EVBUFFER_LENGTH(evb) == 0)
 		return;
@@ -871,14 +972,26 @@ input_parse(struct window_pane *wp)
 	while (off < len) {
 		ictx->ch = buf[off++];
 
-		/* Find the transition. */
-		itr = ictx->state->transitions;
-		while (itr->first != -1 && itr->last != -1) {
-			if (ictx->ch >= itr->first && ictx->ch <= itr->last)
-				break;
-			itr++;
+		/*
+		 * Printable ASCII in the ground state doesn't change state,
+		 * so write the whole run at once.
+		 */
+		if (ictx->state == &input_state_ground &&
+		    ictx->ch >= 0x20 && ictx->ch <= 0x7e) {
+			end = off;
+			while (end < len && buf[end] >= 0x20 && buf[end] <= 0x7e)
+				end++;
+			if (end != off) {
+				input_print_run(ictx, buf + off - 1, end - off + 1);
+				ictx->ch = buf[end - 1];
+				off = end;
+				continue;
+			}
 		}
-		if (itr->first == -1 || itr->last == -1) {
+
+		/* Find the transition. */
+		itr = ictx->state->dispatch[ictx->ch];
+		if (itr == NULL) {
 			/* No transition? Eh? */
 			fatalx("no transition from state");
 		}
@@ -1016,6 +1129,23 @@ input_print(struct input_ctx *ictx)
 	return (0);
 }
 
+/* Output a run of printable ASCII characters. */
+void
+input_print_run(struct input_ctx *ictx, const u_char *buf, u_int len)
+{
+	int	set;
+
+	set = ictx->cell.set == 0 ? ictx->cell.g0set : ictx->cell.g1set;
+	if (set == 1)
+		ictx->cell.cell.attr |= GRID_ATTR_CHARSET;
+	else
+		ictx->cell.cell.attr &= ~GRID_ATTR_CHARSET;
+
+	screen_write_run(&ictx->ctx, &ictx->cell.cell, buf, len);
+
+	ictx->cell.cell.attr &= ~GRID_ATTR_CHARSET;
+}
+
 /* Collect intermediate string. */
 int
 input_intermediate(struct input_ctx *ictx)
@@ -23,9 +23,9 @@
 #include "tmux.h"
 
 int	screen_redraw_cell_border1(struct window_pane *, u_int, u_int);
-int	screen_redraw_cell_border(struct client *, u_int, u_int);
-int	screen_redraw_check_cell(struct client *, u_int, u_int,
-	    struct window_pane **);
+int	screen_redraw_cells_valid(struct window *);
+int	screen_redraw_cell_border(struct window *, u_int, u_int);
+int	screen_redraw_cell_type(struct window *, u_int, u_int);
 int	screen_redraw_check_is(u_int, u_int, int, struct window *,
 	    struct window_pane *, struct window_pane *);
 
@@ -79,100 +79,174 @@ screen_redraw_cell_border1(struct window_pane *wp, u_int px, u_int py)
 	return (-1);
 }
 
-/* Check if a cell is on the pane border. */
+/* Check if the border map of a window was built from its current panes. */
 int
-screen_redraw_cell_border(struct client *c, u_int px, u_int py)
+screen_redraw_cells_valid(struct window *w)
 {
-	struct window		*w = c->session->curw->window;
 	struct window_pane	*wp;
-	int			 retval;
+	struct window_cell_pane	*cp;
+	u_int			 n;
+
+	if (w->cells == NULL || w->cellsx != w->sx + 1 ||
+	    w->cellsy != w->sy + 1)
+		return (0);
 
-	/* Check all the panes. */
+	n = 0;
 	TAILQ_FOREACH(wp, &w->panes, entry) {
-		if (!window_pane_visible(wp))
-			continue;
-		if ((retval = screen_redraw_cell_border1(wp, px, py)) != -1)
-			return (retval);
+		if (n == w->ncellpanes)
+			return (0);
+		cp = &w->cellpanes[n++];
+		if (cp->wp != wp ||
+		    cp->xoff != wp->xoff || cp->yoff != wp->yoff ||
+		    cp->sx != wp->sx || cp->sy != wp->sy ||
+		    cp->visible != window_pane_visible(wp))
+			return (0);
 	}
-
-	return (0);
+	return (n == w->ncellpanes);
 }
 
-/* Check if cell inside a pane. */
+/*
+ * Check if a cell in the map is on the pane border: it belongs to a pane but
+ * is not inside it.
+ */
 int
-screen_redraw_check_cell(struct client *c, u_int px, u_int py,
-    struct window_pane **wpp)
+screen_redraw_cell_border(struct window *w, u_int px, u_int py)
 {
-	struct window		*w = c->session->curw->window;
 	struct window_pane	*wp;
-	int			 borders;
 
-	if (px > w->sx || py > w->sy)
+	if (px >= w->cellsx || py >= w->cellsy)
+		return (0);
+	wp = w->cells[py * w->cellsx + px].wp;
+	if (wp == NULL)
+		return (0);
+	return (px < wp->xoff || px >= wp->xoff + wp->sx ||
+	    py < wp->yoff || py >= wp->yoff + wp->sy);
+}
+
+/* Work out the type of a cell in the map from the cells around it. */
+int
+screen_redraw_cell_type(struct window *w, u_int px, u_int py)
+{
+	int	borders;
+
+	if (w->cells[py * w->cellsx + px].wp == NULL)
 		return (CELL_OUTSIDE);
+	if (!screen_redraw_cell_border(w, px, py))
+		return (CELL_INSIDE);
+
+	/*
+	 * Construct a bitmask of whether the cells to the left (bit 4),
+	 * right, top, and bottom (bit 1) of this cell are borders.
+	 */
+	borders = 0;
+	if (px == 0 || screen_redraw_cell_border(w, px - 1, py))
+		borders |= 8;
+	if (screen_redraw_cell_border(w, px + 1, py))
+		borders |= 4;
+	if (py == 0 || screen_redraw_cell_border(w, px, py - 1))
+		borders |= 2;
+	if (screen_redraw_cell_border(w, px, py + 1))
+		borders |= 1;
+
+	/*
+	 * Figure out what kind of border this cell is. Only one bit set
+	 * doesn't make sense (can't have a border cell with no others
+	 * connected).
+	 */
+	switch (borders) {
+	case 15:	/* 1111, left right top bottom */
+		return (CELL_JOIN);
+	case 14:	/* 1110, left right top */
+		return (CELL_BOTTOMJOIN);
+	case 13:	/* 1101, left right bottom */
+		return (CELL_TOPJOIN);
+	case 12:	/* 1100, left right */
+		return (CELL_TOPBOTTOM);
+	case 11:	/* 1011, left top bottom */
+		return (CELL_RIGHTJOIN);
+	case 10:	/* 1010, left top */
+		return (CELL_BOTTOMRIGHT);
+	case 9:		/* 1001, left bottom */
+		return (CELL_TOPRIGHT);
+	case 7:		/* 0111, right top bottom */
+		return (CELL_LEFTJOIN);
+	case 6:		/* 0110, right top */
+		return (CELL_BOTTOMLEFT);
+	case 5:		/* 0101, right bottom */
+		return (CELL_TOPLEFT);
+	case 3:		/* 0011, top bottom */
+		return (CELL_LEFTRIGHT);
+	}
+	return (CELL_OUTSIDE);
+}
+
+/*
+ * Build the border map of a window if the panes have changed since it was
+ * last built. Each cell belongs to the first pane in the list whose border
+ * surrounds it, so the panes are filled in from the end of the list.
+ */
+void
+screen_redraw_update_cells(struct window *w)
+{
+	struct window_pane	*wp;
+	struct window_cell	*cell;
+	struct window_cell_pane	*cp;
+	u_int			 sx, sy, n, i, j, x0, y0;
+
+	if (screen_redraw_cells_valid(w))
+		return;
 
+	n = window_count_panes(w);
+	if (n != 0) {
+		w->cellpanes = xreallocarray(w->cellpanes, n,
+		    sizeof *w->cellpanes);
+	}
+	w->ncellpanes = n;
+
+	n = 0;
 	TAILQ_FOREACH(wp, &w->panes, entry) {
-		if (!window_pane_visible(wp))
-			continue;
-		*wpp = wp;
+		cp = &w->cellpanes[n++];
+		cp->wp = wp;
+		cp->xoff = wp->xoff;
+		cp->yoff = wp->yoff;
+		cp->sx = wp->sx;
+		cp->sy = wp->sy;
+		cp->visible = window_pane_visible(wp);
+	}
 
-		/* If outside the pane and its border, skip it. */
-		if ((wp->xoff != 0 && px < wp->xoff - 1) ||
-		    px > wp->xoff + wp->sx ||
-		    (wp->yoff != 0 && py < wp->yoff - 1) ||
-		    py > wp->yoff + wp->sy)
-			continue;
+	sx = w->cellsx = w->sx + 1;
+	sy = w->cellsy = w->sy + 1;
+	w->cells = xreallocarray(w->cells, sx * sy, sizeof *w->cells);
+	for (i = 0; i < sx * sy; i++) {
+		w->cells[i].wp = NULL;
+		w->cells[i].at = NULL;
+	}
 
-		/* If definitely inside, return so. */
-		if (!screen_redraw_cell_border(c, px, py))
-			return (CELL_INSIDE);
-
-		/*
-		 * Construct a bitmask of whether the cells to the left (bit
-		 * 4), right, top, and bottom (bit 1) of this cell are borders.
-		 */
-		borders = 0;
-		if (px == 0 || screen_redraw_cell_border(c, px - 1, py))
-			borders |= 8;
-		if (px <= w->sx && screen_redraw_cell_border(c, px + 1, py))
-			borders |= 4;
-		if (py == 0 || screen_redraw_cell_border(c, px, py - 1))
-			borders |= 2;
-		if (py <= w->sy && screen_redraw_cell_border(c, px, py + 1))
-			borders |= 1;
-
-		/*
-		 * Figure out what kind of border this cell is. Only one bit
-		 * set doesn't make sense (can't have a border cell with no
-		 * others connected).
-		 */
-		switch (borders) {
-		case 15:	/* 1111, left right top bottom */
-			return (CELL_JOIN);
-		case 14:	/* 1110, left right top */
-			return (CELL_BOTTOMJOIN);
-		case 13:	/* 1101, left right bottom */
-			return (CELL_TOPJOIN);
-		case 12:	/* 1100, left right */
-			return (CELL_TOPBOTTOM);
-		case 11:	/* 1011, left top bottom */
-			return (CELL_RIGHTJOIN);
-		case 10:	/* 1010, left top */
-			return (CELL_BOTTOMRIGHT);
-		case 9:		/* 1001, left bottom */
-			return (CELL_TOPRIGHT);
-		case 7:		/* 0111, right top bottom */
-			return (CELL_LEFTJOIN);
-		case 6:		/* 0110, right top */
-			return (CELL_BOTTOMLEFT);
-		case 5:		/* 0101, right bottom */
-			return (CELL_TOPLEFT);
-		case 3:		/* 0011, top bottom */
-			return (CELL_LEFTRIGHT);
+	TAILQ_FOREACH_REVERSE(wp, &w->panes, window_panes, entry) {
+		if (!window_pane_visible(wp))
+			continue;
+		x0 = (wp->xoff == 0) ? 0 : wp->xoff - 1;
+		y0 = (wp->yoff == 0) ? 0 : wp->yoff - 1;
+		for (j = y0; j <= wp->yoff + wp->sy; j++) {
+			cell = &w->cells[j * sx];
+			for (i = x0; i <= wp->xoff + wp->sx; i++) {
+				cell[i].wp = wp;
+				if (i >= wp->xoff && j >= wp->yoff)
+					cell[i].at = wp;
+			}
 		}
 	}
 
-	*wpp = NULL;
-	return (CELL_OUTSIDE);
+	for (j = 0; j < sy; j++) {
+		for (i = 0; i < sx; i++) {
+			cell = &w->cells[j * sx + i];
+			cell->type = screen_redraw_cell_type(w, i, j);
+		}
+	}
+	for (i = 0; i < sx * sy; i++) {
+		if (w->cells[i].type == CELL_OUTSIDE)
+			w->cells[i].wp = NULL;
+	}
 }
 
 /* Check if the border of a particular pane. */
@@ -281,6 +355,8 @@ screen_redraw_draw_borders(struct client *c, int status, u_int top)
 	struct window_pane	*wp = NULL;
 	struct grid_cell	 m_active_gc, active_gc, m_other_gc, other_gc;
 	struct grid_cell	 msg_gc;
+	struct grid_cell	*gc;
+	struct window_cell	*cell;
 	u_int		 	 i, j, type, msgx = 0, msgy = 0;
 	int			 active, small, flags;
 	char			 msg[256];
@@ -321,9 +397,15 @@ screen_redraw_draw_borders(struct client *c, int status, u_int top)
 	memcpy(&m_active_gc, &active_gc, sizeof m_active_gc);
 	m_active_gc.attr ^= GRID_ATTR_REVERSE;
 
+	screen_redraw_update_cells(w);
 	for (j = 0; j < tty->sy - status; j++) {
 		for (i = 0; i < tty->sx; i++) {
-			type = screen_redraw_check_cell(c, i, j, &wp);
+			if (i < w->cellsx && j < w->cellsy) {
+				cell = &w->cells[j * w->cellsx + i];
+				type = cell->type;
+				wp = cell->wp;
+			} else
+				type = CELL_OUTSIDE;
 			if (type == CELL_INSIDE)
 				continue;
 			if (type == CELL_OUTSIDE && small &&
@@ -335,13 +417,17 @@ screen_redraw_draw_borders(struct client *c, int status, u_int top)
 			    screen_redraw_check_is(i, j, type, w,
 			    marked_pane.wp, wp)) {
 				if (active)
-					tty_attributes(tty, &m_active_gc, NULL);
+					gc = &m_active_gc;
 				else
-					tty_attributes(tty, &m_other_gc, NULL);
+					gc = &m_other_gc;
 			} else if (active)
-				tty_attributes(tty, &active_gc, NULL);
+				gc = &active_gc;
 			else
-				tty_attributes(tty, &other_gc, NULL);
+				gc = &other_gc;
+			utf8_set(&gc->data, CELL_BORDERS[type]);
+			if (tty_cell_shown(tty, i, top + j, gc, NULL))
+				continue;
+			tty_attributes(tty, gc, NULL);
 			tty_cursor(tty, i, top + j);
 			tty_putc(tty, CELL_BORDERS[type]);
 		}
@@ -351,7 +437,7 @@ screen_redraw_draw_borders(struct client *c, int status, u_int top)
 		memcpy(&msg_gc, &grid_default_cell, sizeof msg_gc);
 		tty_attributes(tty, &msg_gc, NULL);
 		tty_cursor(tty, msgx, msgy);
-		tty_puts(tty, msg);
+		tty_putn(tty, msg, msglen, msglen);
 	}
 }
 
@@ -456,7 +542,7 @@ draw_text:
 	else
 		colour_set_fg(&gc, colour);
 	tty_attributes(tty, &gc, wp);
-	tty_puts(tty, buf);
+	tty_putn(tty, buf, len, len);
 
 	tty_cursor(tty, 0, 0);
 }
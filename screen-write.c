@@ -24,6 +24,8 @@
 #include "tmux.h"
 
 void	screen_write_initctx(struct screen_write_ctx *, struct tty_ctx *, int);
+void	screen_write_dirty(struct screen_write_ctx *, u_int, u_int);
+void	screen_write_flush(struct screen_write_ctx *);
 void	screen_write_overwrite(struct screen_write_ctx *, u_int);
 int	screen_write_combine(struct screen_write_ctx *,
 	    const struct utf8_data *);
@@ -38,12 +40,89 @@ screen_write_start(struct screen_write_ctx *ctx, struct window_pane *wp,
 		ctx->s = wp->screen;
 	else
 		ctx->s = s;
+
+	ctx->dirty = NULL;
+	ctx->dirtysize = 0;
+	ctx->dirtyupper = UINT_MAX;
+	ctx->dirtylower = 0;
 }
 
 /* Finish writing. */
 void
-screen_write_stop(__unused struct screen_write_ctx *ctx)
+screen_write_stop(struct screen_write_ctx *ctx)
+{
+	screen_write_flush(ctx);
+
+	free(ctx->dirty);
+	ctx->dirty = NULL;
+	ctx->dirtysize = 0;
+}
+
+/*
+ * Mark cells on the cursor line as changed. Cells are not drawn as they are
+ * written but collected and drawn together, so cells overwritten before then
+ * are only drawn once.
+ */
+void
+screen_write_dirty(struct screen_write_ctx *ctx, u_int px, u_int nx)
+{
+	struct screen	*s = ctx->s;
+	u_int		 sy = screen_size_y(s), py = s->cy, *d;
+
+	if (ctx->wp == NULL || nx == 0)
+		return;
+
+	if (ctx->dirtysize < sy) {
+		ctx->dirty = xreallocarray(ctx->dirty, sy, 2 * sizeof *d);
+		memset(ctx->dirty + 2 * ctx->dirtysize, 0,
+		    (sy - ctx->dirtysize) * 2 * sizeof *d);
+		ctx->dirtysize = sy;
+	}
+
+	d = &ctx->dirty[2 * py];
+	if (d[0] == d[1]) {
+		d[0] = px;
+		d[1] = px + nx;
+	} else {
+		if (px < d[0])
+			d[0] = px;
+		if (px + nx > d[1])
+			d[1] = px + nx;
+	}
+
+	if (py < ctx->dirtyupper)
+		ctx->dirtyupper = py;
+	if (py > ctx->dirtylower)
+		ctx->dirtylower = py;
+}
+
+/* Draw any changed cells. */
+void
+screen_write_flush(struct screen_write_ctx *ctx)
 {
+	struct tty_ctx	 ttyctx;
+	u_int		 upper, lower, py, *d;
+
+	upper = ctx->dirtyupper;
+	lower = ctx->dirtylower;
+	if (upper > lower)
+		return;
+	ctx->dirtyupper = UINT_MAX;
+	ctx->dirtylower = 0;
+
+	screen_write_initctx(ctx, &ttyctx, 0);
+	for (py = upper; py <= lower; py++) {
+		d = &ctx->dirty[2 * py];
+		if (d[0] == d[1])
+			continue;
+
+		ttyctx.ocx = d[0];
+		ttyctx.ocy = py;
+		ttyctx.num = d[1] - d[0];
+		tty_write(tty_cmd_cells, &ttyctx);
+
+		d[0] = d[1] = 0;
+	}
 }
 
 /* Reset screen state. */
@@ -313,7 +392,7 @@ screen_write_copy(struct screen_write_ctx *ctx,
 	cx = s->cx;
 	cy = s->cy;
 	for (yy = py; yy < py + ny; yy++) {
-		gl = &gd->linedata[yy];
+		gl = grid_get_line(gd, yy);
 		if (yy < gd->hsize + gd->sy) {
 			/*
 			 * Find start and end position and copy between
@@ -353,6 +432,9 @@ screen_write_initctx(struct screen_write_ctx *ctx, struct tty_ctx *ttyctx,
 	struct grid_cell	 gc;
 	u_int			 xx;
 
+	/* Anything changed so far must be drawn first. */
+	screen_write_flush(ctx);
+
 	ttyctx->wp = ctx->wp;
 
 	ttyctx->ocx = s->cx;
@@ -489,7 +571,7 @@ screen_write_backspace(struct screen_write_ctx *ctx)
 	if (s->cx == 0) {
 		if (s->cy == 0)
 			return;
-		gl = &s->grid->linedata[s->grid->hsize + s->cy - 1];
+		gl = grid_get_line(s->grid, s->grid->hsize + s->cy - 1);
 		if (gl->flags & GRID_LINE_WRAPPED) {
 			s->cy--;
 			s->cx = screen_size_x(s) - 1;
@@ -797,7 +879,7 @@ screen_write_linefeed(struct screen_write_ctx *ctx, int wrapped)
 
 	screen_write_initctx(ctx, &ttyctx, 0);
 
-	gl = &s->grid->linedata[s->grid->hsize + s->cy];
+	gl = grid_get_line(s->grid, s->grid->hsize + s->cy);
 	if (wrapped)
 		gl->flags |= GRID_LINE_WRAPPED;
 	else
@@ -906,9 +988,9 @@ screen_write_cell(struct screen_write_ctx *ctx, const struct grid_cell *gc)
 	struct screen		*s = ctx->s;
 	struct grid		*gd = s->grid;
 	struct tty_ctx		 ttyctx;
-	u_int		 	 width, xx, last;
+	u_int		 	 width, xx, px, last;
 	struct grid_cell 	 tmp_gc;
-	int			 insert;
+	int			 insert, defer;
 
 	/* Ignore padding. */
 	if (gc->flags & GRID_FLAG_PADDING)
@@ -937,8 +1019,18 @@ screen_write_cell(struct screen_write_ctx *ctx, const struct grid_cell *gc)
 		return;
 	}
 
+	/*
+	 * Plain cells are drawn later with the rest of the line. A cell that
+	 * wraps is drawn now, as the terminal may rely on its own wrapping to
+	 * scroll.
+	 */
+	defer = (ctx->wp != NULL && !s->sel.flag &&
+	    (~s->mode & MODE_INSERT) &&
+	    (!(s->mode & MODE_WRAP) || s->cx <= screen_size_x(s) - width));
+
 	/* Initialise the redraw context, saving the last cell. */
-	screen_write_initctx(ctx, &ttyctx, 1);
+	if (!defer)
+		screen_write_initctx(ctx, &ttyctx, 1);
 
 	/* If in insert mode, make space for the cells. */
 	if ((s->mode & MODE_INSERT) && s->cx <= screen_size_x(s) - width) {
@@ -973,6 +1065,7 @@ screen_write_cell(struct screen_write_ctx *ctx, const struct grid_cell *gc)
 
 	/* Set the cell. */
 	grid_view_set_cell(gd, s->cx, s->cy, gc);
+	px = s->cx;
 
 	/*
 	 * Move the cursor. If not wrapping, stick at the last character and
@@ -984,6 +1077,11 @@ screen_write_cell(struct screen_write_ctx *ctx, const struct grid_cell *gc)
 	else
 		s->cx = screen_size_x(s) - last;
 
+	if (defer) {
+		screen_write_dirty(ctx, px, width);
+		return;
+	}
+
 	/* Draw to the screen if necessary. */
 	if (insert) {
 		ttyctx.num = width;
@@ -1007,6 +1105,46 @@ screen_write_cell(struct screen_write_ctx *ctx, const struct grid_cell *gc)
 	}
 }
 
+/*
+ * Write a run of printable ASCII characters with the same attributes. The
+ * characters fitting on the line are written in one go, the rest (and any
+ * case needing more care) goes through screen_write_cell.
+ */
+void
+screen_write_run(struct screen_write_ctx *ctx, const struct grid_cell *gc,
+    const u_char *buf, u_int len)
+{
+	struct screen		*s = ctx->s;
+	struct grid_cell	 tmp_gc;
+	u_int			 n, last;
+
+	last = !(s->mode & MODE_WRAP);
+	while (len > 0) {
+		if (s->mode & MODE_INSERT || s->sel.flag ||
+		    s->cx + last >= screen_size_x(s) ||
+		    s->cy > screen_size_y(s) - 1) {
+			memcpy(&tmp_gc, gc, sizeof tmp_gc);
+			utf8_set(&tmp_gc.data, *buf);
+			screen_write_cell(ctx, &tmp_gc);
+			buf++;
+			len--;
+			continue;
+		}
+
+		n = screen_size_x(s) - last - s->cx;
+		if (n > len)
+			n = len;
+
+		screen_write_overwrite(ctx, n);
+		grid_view_set_cells(s->grid, s->cx, s->cy, gc, buf, n);
+		screen_write_dirty(ctx, s->cx, n);
+		s->cx += n;
+
+		buf += n;
+		len -= n;
+	}
+}
+
 /* Combine a UTF-8 zero-width character onto the previous. */
 int
 screen_write_combine(struct screen_write_ctx *ctx, const struct utf8_data *ud)
@@ -1074,6 +1212,7 @@ screen_write_overwrite(struct screen_write_ctx *ctx, u_int width)
 
 		/* Overwrite the character at the start of this padding. */
 		grid_view_set_cell(gd, xx, s->cy, &grid_default_cell);
+		screen_write_dirty(ctx, xx, s->cx - xx);
 	}
 
 	/*
@@ -1087,6 +1226,8 @@ screen_write_overwrite(struct screen_write_ctx *ctx, u_int width)
 			break;
 		grid_view_set_cell(gd, xx, s->cy, &grid_default_cell);
 	}
+	if (xx > s->cx + width)
+		screen_write_dirty(ctx, s->cx + width, xx - s->cx - width);
 }
 
 void
@@ -206,9 +206,12 @@ screen_resize_y(struct screen *s, u_int sy)
 		s->cy -= needed;
 	}
 
+	/* Make sure all the history is there if it might be needed. */
+	if (sy > oldy && gd->hsize < sy - oldy)
+		grid_reflow_finish(gd);
+
 	/* Resize line arrays. */
-	gd->linedata = xreallocarray(gd->linedata, gd->hsize + sy,
-	    sizeof *gd->linedata);
+	grid_adjust_lines(gd, gd->hsize + sy);
 
 	/* Size increasing. */
 	if (sy > oldy) {
@@ -230,7 +233,7 @@ screen_resize_y(struct screen *s, u_int sy)
 
 		/* Then fill the rest in with blanks. */
 		for (i = gd->hsize + sy - needed; i < gd->hsize + sy; i++)
-			memset(&gd->linedata[i], 0, sizeof gd->linedata[i]);
+			memset(grid_get_line(gd, i), 0, sizeof *gd->linedata);
 	}
 
 	/* Set the new size, and reset the scroll region. */
@@ -370,6 +373,7 @@ screen_reflow(struct screen *s, u_int new_x)
 	u_int		 change;
 
 	s->grid = grid_create(old->sx, old->sy, old->hlimit);
+	s->grid->flags |= old->flags & GRID_HISTORY_FILE;
 
 	change = grid_reflow(s->grid, old, new_x);
 	if (change < s->cy)
@@ -37,6 +37,7 @@ void		server_client_check_resize(struct window_pane *);
 key_code	server_client_check_mouse(struct client *);
 void		server_client_repeat_timer(int, short, void *);
 void		server_client_check_exit(struct client *);
+void		server_client_check_window(struct client *);
 void		server_client_check_redraw(struct client *);
 void		server_client_set_title(struct client *);
 void		server_client_reset_state(struct client *);
@@ -190,6 +191,10 @@ server_client_lost(struct client *c)
 		c->stdin_callback(c, 1, c->stdin_callback_data);
 
 	TAILQ_REMOVE(&clients, c, entry);
+	if (c->window != NULL) {
+		TAILQ_REMOVE(&c->window->viewers, c, wentry);
+		c->window = NULL;
+	}
 	log_debug("lost client %p", c);
 
 	/*
@@ -746,6 +751,7 @@ server_client_loop(void)
 
 	TAILQ_FOREACH(c, &clients, entry) {
 		server_client_check_exit(c);
+		server_client_check_window(c);
 		if (c->session != NULL) {
 			server_client_check_redraw(c);
 			server_client_reset_state(c);
@@ -945,6 +951,30 @@ server_client_check_exit(struct client *c)
 	c->flags &= ~CLIENT_EXIT;
 }
 
+/*
+ * Move client onto the viewer list of the window it is showing. Anything that
+ * changes the window also redraws the client, so output written before this
+ * runs is not lost.
+ */
+void
+server_client_check_window(struct client *c)
+{
+	struct window	*w;
+
+	if (c->session != NULL && c->session->curw != NULL)
+		w = c->session->curw->window;
+	else
+		w = NULL;
+	if (w == c->window)
+		return;
+
+	if (c->window != NULL)
+		TAILQ_REMOVE(&c->window->viewers, c, wentry);
+	if (w != NULL)
+		TAILQ_INSERT_TAIL(&w->viewers, c, wentry);
+	c->window = w;
+}
+
 /* Check for client redraws. */
 void
 server_client_check_redraw(struct client *c)
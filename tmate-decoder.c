@@ -192,6 +192,24 @@ static void handle_ready(struct tmate_session *session,
 	signal_waiting_clients("tmate-ready");
 }
 
+static void handle_header(struct tmate_session *session,
+			  struct tmate_unpacker *uk)
+{
+	session->daemon_protocol_version = unpack_int(uk);
+}
+
+static void handle_sync_layout(__unused struct tmate_session *session,
+			       __unused struct tmate_unpacker *uk)
+{
+	tmate_sync_full_layout();
+}
+
+static void handle_resume(struct tmate_session *session,
+			  struct tmate_unpacker *uk)
+{
+	tmate_resume_session(session, unpack_int(uk));
+}
+
 void tmate_dispatch_slave_message(struct tmate_session *session,
 				  struct tmate_unpacker *uk)
 {
@@ -206,6 +224,9 @@ void tmate_dispatch_slave_message(struct tmate_session *session,
 	dispatch(TMATE_IN_READY,		handle_ready);
 	dispatch(TMATE_IN_PANE_KEY,		handle_pane_key);
 	dispatch(TMATE_IN_EXEC_CMD,		handle_exec_cmd);
+	dispatch(TMATE_IN_HEADER,		handle_header);
+	dispatch(TMATE_IN_SYNC_LAYOUT,		handle_sync_layout);
+	dispatch(TMATE_IN_RESUME,		handle_resume);
 	default: tmate_info("Bad message type: %d", cmd);
 	}
 }
@@ -3,12 +3,44 @@
 #include "tmate-protocol.h"
 #include "window-copy.h"
 
+#define TMATE_RESUME_TIMEOUT 10
+
 #define pack(what, ...) _pack(&tmate_session.encoder, what, ##__VA_ARGS__)
 
+static void pack_message(unsigned int size, int type);
+
+static const char *out_msg_names[] = {
+	[TMATE_OUT_HEADER]		= "header",
+	[TMATE_OUT_SYNC_LAYOUT]		= "sync-layout",
+	[TMATE_OUT_PTY_DATA]		= "pty-data",
+	[TMATE_OUT_EXEC_CMD_STR]	= "exec-cmd-str",
+	[TMATE_OUT_FAILED_CMD]		= "failed-cmd",
+	[TMATE_OUT_STATUS]		= "status",
+	[TMATE_OUT_SYNC_COPY_MODE]	= "sync-copy-mode",
+	[TMATE_OUT_WRITE_COPY_MODE]	= "write-copy-mode",
+	[TMATE_OUT_FIN]			= "fin",
+	[TMATE_OUT_READY]		= "ready",
+	[TMATE_OUT_RECONNECT]		= "reconnect",
+	[TMATE_OUT_SNAPSHOT]		= "snapshot",
+	[TMATE_OUT_EXEC_CMD]		= "exec-cmd",
+	[TMATE_OUT_UNAME]		= "uname",
+	[TMATE_OUT_SYNC_LAYOUT_DELTA]	= "sync-layout-delta",
+	[TMATE_OUT_SNAPSHOT_RLE]	= "snapshot-rle",
+	[TMATE_OUT_RESUME]		= "resume",
+	[TMATE_OUT_RESYNC]		= "resync",
+};
+
+const char *tmate_out_msg_name(int type)
+{
+	if (type < 0 || type >= (int)nitems(out_msg_names) ||
+	    !out_msg_names[type])
+		return "unknown";
+	return out_msg_names[type];
+}
+
 void tmate_write_header(void)
 {
-	pack(array, 3);
-	pack(int, TMATE_OUT_HEADER);
+	pack_message(3, TMATE_OUT_HEADER);
 	pack(int, TMATE_PROTOCOL_VERSION);
 	pack(string, VERSION);
 }
@@ -21,8 +53,7 @@ void tmate_write_uname(void)
 		return;
 	}
 
-	pack(array, 6);
-	pack(int, TMATE_OUT_UNAME);
+	pack_message(6, TMATE_OUT_UNAME);
 	pack(string, name.sysname);
 	pack(string, name.nodename);
 	pack(string, name.release);
@@ -32,27 +63,37 @@ void tmate_write_uname(void)
 
 void tmate_write_ready(void)
 {
-	pack(array, 1);
-	pack(int, TMATE_OUT_READY);
+	pack_message(1, TMATE_OUT_READY);
 }
 
-void tmate_sync_layout(void)
+/*
+ * The layout we last sent is kept around, so that when the daemon supports
+ * it, we only send what changed instead of the whole layout. Syncs happen
+ * at every shell command because of automatic-rename, so it adds up.
+ */
+
+static void free_layout(struct tmate_layout *layout)
+{
+	unsigned int i;
+
+	for (i = 0; i < layout->num_windows; i++) {
+		free(layout->windows[i].name);
+		free(layout->windows[i].panes);
+	}
+	free(layout->windows);
+	memset(layout, 0, sizeof(*layout));
+}
+
+static int capture_layout(struct tmate_layout *layout)
 {
 	struct session *s;
 	struct winlink *wl;
 	struct window *w;
 	struct window_pane *wp;
-	int num_panes = 0;
-	int num_windows = 0;
-	int active_pane_id;
-	int active_window_idx = -1;
+	struct tmate_layout_window *lw;
+	struct tmate_layout_pane *lp;
 
-	/*
-	 * TODO this can get a little heavy.
-	 * We are shipping the full layout whenever a window name changes,
-	 * that is, at every shell command.
-	 * Might be better to do something incremental.
-	 */
+	memset(layout, 0, sizeof(*layout));
 
 	/*
 	 * We only allow one session, it makes our lives easier.
@@ -63,80 +104,268 @@ void tmate_sync_layout(void)
 
 	s = RB_MIN(sessions, &sessions);
 	if (!s)
-		return;
+		return -1;
 
-	num_windows = 0;
 	RB_FOREACH(wl, winlinks, &s->windows) {
 		if (wl->window)
-			num_windows++;
+			layout->num_windows++;
 	}
 
-	if (!num_windows)
-		return;
+	if (!layout->num_windows)
+		return -1;
 
-	pack(array, 5);
-	pack(int, TMATE_OUT_SYNC_LAYOUT);
+	layout->sx = s->sx;
+	layout->sy = s->sy;
+	layout->active_window_idx = -1;
+	layout->windows = xcalloc(layout->num_windows, sizeof(*layout->windows));
 
-	pack(int, s->sx);
-	pack(int, s->sy);
-
-	pack(array, num_windows);
+	lw = layout->windows;
 	RB_FOREACH(wl, winlinks, &s->windows) {
 		w = wl->window;
 		if (!w)
 			continue;
 
 		w->tmate_last_sync_active_pane = NULL;
-		active_pane_id = -1;
 
-		if (active_window_idx == -1)
-			active_window_idx = wl->idx;
+		if (layout->active_window_idx == -1)
+			layout->active_window_idx = wl->idx;
 
-		pack(array, 4);
-		pack(int, wl->idx);
-		pack(string, w->name);
+		lw->idx = wl->idx;
+		lw->name = xstrdup(w->name);
+		lw->active_pane_id = -1;
 
-		num_panes = 0;
 		TAILQ_FOREACH(wp, &w->panes, entry)
-			num_panes++;
+			lw->num_panes++;
 
-		pack(array, num_panes);
+		if (lw->num_panes)
+			lw->panes = xcalloc(lw->num_panes, sizeof(*lw->panes));
+		lp = lw->panes;
 		TAILQ_FOREACH(wp, &w->panes, entry) {
-			pack(array, 5);
-			pack(int, wp->id);
-			pack(int, wp->sx);
-			pack(int, wp->sy);
-			pack(int, wp->xoff);
-			pack(int, wp->yoff);
+			lp->id = wp->id;
+			lp->sx = wp->sx;
+			lp->sy = wp->sy;
+			lp->xoff = wp->xoff;
+			lp->yoff = wp->yoff;
+			lp++;
 
 			if (wp == w->active) {
 				w->tmate_last_sync_active_pane = wp;
-				active_pane_id = wp->id;
+				lw->active_pane_id = wp->id;
 			}
-
 		}
-		pack(int, active_pane_id);
+		lw++;
 	}
 
 	if (s->curw)
-		active_window_idx = s->curw->idx;
+		layout->active_window_idx = s->curw->idx;
+
+	layout->valid = true;
+	return 0;
+}
+
+static void pack_layout_panes(struct tmate_layout_window *lw)
+{
+	struct tmate_layout_pane *lp;
+	unsigned int i;
+
+	pack(array, lw->num_panes);
+	for (i = 0; i < lw->num_panes; i++) {
+		lp = &lw->panes[i];
+		pack(array, 5);
+		pack(int, lp->id);
+		pack(int, lp->sx);
+		pack(int, lp->sy);
+		pack(int, lp->xoff);
+		pack(int, lp->yoff);
+	}
+}
+
+static void pack_full_layout(struct tmate_layout *layout)
+{
+	struct tmate_layout_window *lw;
+	unsigned int i;
+
+	pack_message(5, TMATE_OUT_SYNC_LAYOUT);
+
+	pack(int, layout->sx);
+	pack(int, layout->sy);
+
+	pack(array, layout->num_windows);
+	for (i = 0; i < layout->num_windows; i++) {
+		lw = &layout->windows[i];
+		pack(array, 4);
+		pack(int, lw->idx);
+		pack(string, lw->name);
+		pack_layout_panes(lw);
+		pack(int, lw->active_pane_id);
+	}
+
+	pack(int, layout->active_window_idx);
+}
 
-	pack(int, active_window_idx);
+static struct tmate_layout_window *find_layout_window(struct tmate_layout *layout,
+						      int idx)
+{
+	unsigned int i;
+
+	for (i = 0; i < layout->num_windows; i++) {
+		if (layout->windows[i].idx == idx)
+			return &layout->windows[i];
+	}
+	return NULL;
 }
 
-/* TODO add a buffer for pty_data ? */
+static bool same_layout_panes(struct tmate_layout_window *a,
+			      struct tmate_layout_window *b)
+{
+	if (a->num_panes != b->num_panes)
+		return false;
+	if (!a->num_panes)
+		return true;
+	return !memcmp(a->panes, b->panes, sizeof(*a->panes) * a->num_panes);
+}
+
+/*
+ * Walks the differences between two layouts. Returns the number of
+ * operations, and packs them when do_pack is set, so we can size the
+ * msgpack array before packing.
+ */
+static unsigned int diff_layout(struct tmate_layout *old,
+				struct tmate_layout *new, bool do_pack)
+{
+	struct tmate_layout_window *ow, *nw;
+	unsigned int i, num_ops = 0;
+
+	if (old->sx != new->sx || old->sy != new->sy) {
+		num_ops++;
+		if (do_pack) {
+			pack(array, 3);
+			pack(int, TMATE_LAYOUT_SIZE);
+			pack(int, new->sx);
+			pack(int, new->sy);
+		}
+	}
+
+	for (i = 0; i < old->num_windows; i++) {
+		ow = &old->windows[i];
+		if (find_layout_window(new, ow->idx))
+			continue;
+
+		num_ops++;
+		if (do_pack) {
+			pack(array, 2);
+			pack(int, TMATE_LAYOUT_WINDOW_REMOVE);
+			pack(int, ow->idx);
+		}
+	}
+
+	for (i = 0; i < new->num_windows; i++) {
+		nw = &new->windows[i];
+		ow = find_layout_window(old, nw->idx);
+
+		if (!ow) {
+			num_ops++;
+			if (do_pack) {
+				pack(array, 5);
+				pack(int, TMATE_LAYOUT_WINDOW_ADD);
+				pack(int, nw->idx);
+				pack(string, nw->name);
+				pack_layout_panes(nw);
+				pack(int, nw->active_pane_id);
+			}
+			continue;
+		}
+
+		if (strcmp(ow->name, nw->name)) {
+			num_ops++;
+			if (do_pack) {
+				pack(array, 3);
+				pack(int, TMATE_LAYOUT_WINDOW_RENAME);
+				pack(int, nw->idx);
+				pack(string, nw->name);
+			}
+		}
+
+		if (!same_layout_panes(ow, nw)) {
+			num_ops++;
+			if (do_pack) {
+				pack(array, 4);
+				pack(int, TMATE_LAYOUT_WINDOW_PANES);
+				pack(int, nw->idx);
+				pack_layout_panes(nw);
+				pack(int, nw->active_pane_id);
+			}
+		} else if (ow->active_pane_id != nw->active_pane_id) {
+			num_ops++;
+			if (do_pack) {
+				pack(array, 3);
+				pack(int, TMATE_LAYOUT_ACTIVE_PANE);
+				pack(int, nw->idx);
+				pack(int, nw->active_pane_id);
+			}
+		}
+	}
+
+	if (old->active_window_idx != new->active_window_idx) {
+		num_ops++;
+		if (do_pack) {
+			pack(array, 2);
+			pack(int, TMATE_LAYOUT_ACTIVE_WINDOW);
+			pack(int, new->active_window_idx);
+		}
+	}
+
+	return num_ops;
+}
+
+static bool can_send_layout_delta(struct tmate_session *session)
+{
+	return session->last_layout.valid &&
+	       session->daemon_protocol_version >= TMATE_PROTOCOL_LAYOUT_DELTA;
+}
+
+void tmate_sync_layout(void)
+{
+	struct tmate_session *session = &tmate_session;
+	struct tmate_layout layout;
+	unsigned int num_ops;
+
+	if (capture_layout(&layout) < 0) {
+		free_layout(&layout);
+		return;
+	}
+
+	if (can_send_layout_delta(session)) {
+		num_ops = diff_layout(&session->last_layout, &layout, false);
+		if (num_ops) {
+			pack_message(2, TMATE_OUT_SYNC_LAYOUT_DELTA);
+			pack(array, num_ops);
+			diff_layout(&session->last_layout, &layout, true);
+		}
+	} else {
+		pack_full_layout(&layout);
+	}
+
+	free_layout(&session->last_layout);
+	session->last_layout = layout;
+}
+
+void tmate_sync_full_layout(void)
+{
+	free_layout(&tmate_session.last_layout);
+	tmate_sync_layout();
+}
 
 #define TMATE_MAX_PTY_SIZE (16*1024)
 
-void tmate_pty_data(struct window_pane *wp, const char *buf, size_t len)
+static void pack_pty_data(struct window_pane *wp, const char *buf, size_t len)
 {
 	size_t to_write;
 
 	while (len > 0) {
 		to_write = len < TMATE_MAX_PTY_SIZE ? len : TMATE_MAX_PTY_SIZE;
 
-		pack(array, 3);
-		pack(int, TMATE_OUT_PTY_DATA);
+		pack(message, 3, TMATE_OUT_PTY_DATA);
 		pack(int, wp->id);
 		pack(str, to_write);
 		pack(str_body, buf, to_write);
@@ -146,6 +375,166 @@ void tmate_pty_data(struct window_pane *wp, const char *buf, size_t len)
 	}
 }
 
+/*
+ * PTY data is coalesced per pane, and flushed when the buffer is large
+ * enough, when tmate-pty-flush-delay expires, or right away when the pane
+ * just received keys so typing stays snappy.
+ */
+
+static void flush_pty_data(struct window_pane *wp, int reason)
+{
+	struct evbuffer *evb = wp->tmate_pty_buffer;
+	size_t len;
+
+	if (!evb || !(len = EVBUFFER_LENGTH(evb)))
+		return;
+
+	evtimer_del(&wp->tmate_pty_timer);
+	tmate_session.pending_pty_panes--;
+	tmate_session.pty_flushes[reason]++;
+
+	pack_pty_data(wp, EVBUFFER_DATA(evb), len);
+	evbuffer_drain(evb, len);
+}
+
+static void flush_all_pty_data(int reason)
+{
+	struct window_pane *wp;
+
+	if (!tmate_session.pending_pty_panes)
+		return;
+
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes)
+		flush_pty_data(wp, reason);
+}
+
+static void drop_pty_data(struct window_pane *wp)
+{
+	struct evbuffer *evb = wp->tmate_pty_buffer;
+	size_t len;
+
+	if (!evb || !(len = EVBUFFER_LENGTH(evb)))
+		return;
+
+	evtimer_del(&wp->tmate_pty_timer);
+	tmate_session.pending_pty_panes--;
+	tmate_session.pty_dropped_bytes += len;
+	evbuffer_drain(evb, len);
+}
+
+static void drop_all_pty_data(void)
+{
+	struct window_pane *wp;
+
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes) {
+		drop_pty_data(wp);
+		wp->tmate_pty_dropped = 0;
+	}
+	tmate_session.dropped_pty_panes = 0;
+}
+
+/*
+ * When the uplink can't keep up, the encoder backlog would grow without
+ * bounds. Past the high watermark, we stop sending the pane output and send
+ * a snapshot of the pane instead once the backlog is drained.
+ */
+static bool should_drop_pty_data(struct window_pane *wp, size_t len)
+{
+	struct tmate_encoder *encoder = &tmate_session.encoder;
+
+	if (!wp->tmate_pty_dropped) {
+		if (tmate_encoder_backlog(encoder) < encoder->high_watermark)
+			return false;
+
+		tmate_debug("Dropping output of pane %%%u, backlog is %zu bytes",
+			    wp->id, tmate_encoder_backlog(encoder));
+		drop_pty_data(wp);
+		wp->tmate_pty_dropped = 1;
+		tmate_session.dropped_pty_panes++;
+	}
+
+	tmate_session.pty_dropped_bytes += len;
+	return true;
+}
+
+static void on_pty_flush_timer(__unused evutil_socket_t fd,
+			       __unused short what, void *arg)
+{
+	flush_pty_data(arg, TMATE_PTY_FLUSH_DEADLINE);
+}
+
+/*
+ * Messages must reach the daemon in the order they were generated. PTY data
+ * that is still coalescing is sent before anything else.
+ */
+static void pack_message(unsigned int size, int type)
+{
+	if (type != TMATE_OUT_PTY_DATA)
+		flush_all_pty_data(TMATE_PTY_FLUSH_ORDER);
+	pack(message, size, type);
+}
+
+void tmate_pty_data(struct window_pane *wp, const char *buf, size_t len)
+{
+	struct evbuffer *evb = wp->tmate_pty_buffer;
+	struct timeval tv;
+	int delay, echo;
+	size_t flush_size;
+
+	echo = wp->tmate_echo;
+	wp->tmate_echo = 0;
+
+	if (should_drop_pty_data(wp, len))
+		return;
+
+	delay = options_get_number(global_options, "tmate-pty-flush-delay");
+	if (!delay && (!evb || !EVBUFFER_LENGTH(evb))) {
+		pack_pty_data(wp, buf, len);
+		return;
+	}
+
+	if (!evb) {
+		evb = wp->tmate_pty_buffer = evbuffer_new();
+		if (!evb)
+			tmate_fatal("out of memory");
+		evtimer_set(&wp->tmate_pty_timer, on_pty_flush_timer, wp);
+	}
+
+	if (!EVBUFFER_LENGTH(evb)) {
+		tmate_session.pending_pty_panes++;
+		if (delay) {
+			tv.tv_sec = delay / 1000;
+			tv.tv_usec = (delay % 1000) * 1000L;
+			evtimer_add(&wp->tmate_pty_timer, &tv);
+		}
+	}
+
+	if (evbuffer_add(evb, buf, len) < 0)
+		tmate_fatal("out of memory");
+
+	flush_size = options_get_number(global_options, "tmate-pty-flush-size");
+	if (echo)
+		flush_pty_data(wp, TMATE_PTY_FLUSH_ECHO);
+	else if (!delay || EVBUFFER_LENGTH(evb) >= flush_size)
+		flush_pty_data(wp, TMATE_PTY_FLUSH_SIZE);
+}
+
+void tmate_pty_data_free(struct window_pane *wp)
+{
+	if (wp->tmate_pty_dropped) {
+		wp->tmate_pty_dropped = 0;
+		tmate_session.dropped_pty_panes--;
+	}
+
+	if (!wp->tmate_pty_buffer)
+		return;
+
+	flush_pty_data(wp, TMATE_PTY_FLUSH_DESTROY);
+	evtimer_del(&wp->tmate_pty_timer);
+	evbuffer_free(wp->tmate_pty_buffer);
+	wp->tmate_pty_buffer = NULL;
+}
+
 extern const struct cmd_entry cmd_bind_key_entry;
 extern const struct cmd_entry cmd_unbind_key_entry;
 extern const struct cmd_entry cmd_set_option_entry;
@@ -171,17 +560,198 @@ int tmate_should_replicate_cmd(const struct cmd_entry *cmd)
 
 #define sc (&session->saved_tmux_cmds)
 #define SAVED_TMUX_CMD_INITIAL_SIZE 256
+
+/* Flags of the saved tmux commands. */
+#define SAVED_TMUX_CMD_KEEP 0x1		/* Doesn't replace previous commands */
+#define SAVED_TMUX_CMD_PREFIX 0x2	/* Replaces all keys starting with its key */
+
 static void __tmate_exec_cmd_args(int argc, const char **argv);
 
+/*
+ * tmate-set values which add up on the daemon instead of replacing the
+ * previous value.
+ */
+static const char *cumulative_tmate_vals[] = {
+	"authorized_keys",
+	NULL
+};
+
+static char *tmate_set_key(const char *val)
+{
+	const char **ptr;
+	size_t len = strcspn(val, "=");
+	char *key;
+
+	for (ptr = cumulative_tmate_vals; *ptr; ptr++) {
+		if (strlen(*ptr) == len && !strncmp(*ptr, val, len))
+			return xstrdup(val);
+	}
+
+	xasprintf(&key, "%.*s", (int)len, val);
+	return key;
+}
+
+static char *option_cmd_key(const struct cmd_entry *entry,
+			    struct args *args, int *flags)
+{
+	const char *target, *scope;
+	char *key, *name;
+
+	if (args_has(args, 'a') || args_has(args, 'o'))
+		*flags |= SAVED_TMUX_CMD_KEEP;
+
+	if (args_has(args, 's'))
+		scope = "server";
+	else if (entry == &cmd_set_window_option_entry || args_has(args, 'w'))
+		scope = "window";
+	else
+		scope = "session";
+
+	target = args_has(args, 'g') ? "global" : args_get(args, 't');
+	if (!target)
+		target = "";
+
+	if (!strcmp(args->argv[0], "tmate-set") && args->argc == 2)
+		name = tmate_set_key(args->argv[1]);
+	else
+		name = xstrdup(args->argv[0]);
+
+	xasprintf(&key, "option:%s:%s:%s", scope, target, name);
+	free(name);
+	return key;
+}
+
+static char *key_table_key(struct args *args)
+{
+	char *key;
+
+	if (args_has(args, 't'))
+		xasprintf(&key, "key:mode-%s:", args_get(args, 't'));
+	else if (args_has(args, 'T'))
+		xasprintf(&key, "key:%s:", args_get(args, 'T'));
+	else if (args_has(args, 'n'))
+		key = xstrdup("key:root:");
+	else
+		key = xstrdup("key:prefix:");
+	return key;
+}
+
+static char *key_cmd_key(const struct cmd_entry *entry,
+			 struct args *args, int *flags)
+{
+	char *table, *key;
+	key_code keycode;
+
+	table = key_table_key(args);
+
+	if (entry == &cmd_unbind_key_entry && args_has(args, 'a')) {
+		/* Cancels everything bound in the table before */
+		*flags |= SAVED_TMUX_CMD_PREFIX;
+		return table;
+	}
+
+	if (args->argc == 0) {
+		free(table);
+		return NULL;
+	}
+
+	keycode = key_string_lookup_string(args->argv[0]);
+	if (keycode == KEYC_NONE) {
+		free(table);
+		return NULL;
+	}
+
+	xasprintf(&key, "%s%s", table, key_string_lookup_key(keycode));
+	free(table);
+	return key;
+}
+
+/*
+ * Returns what the command sets, so that the command can replace the
+ * previous ones setting the same thing. NULL if it can't be compacted.
+ */
+static char *saved_cmd_key(int argc, const char **argv, int *flags)
+{
+	const struct cmd_entry **ptr, *entry = NULL;
+	struct args *args;
+	char *key = NULL;
+
+	*flags = 0;
+
+	for (ptr = replicated_cmds; *ptr; ptr++) {
+		if (!strcmp((*ptr)->name, argv[0]))
+			entry = *ptr;
+	}
+	if (!entry)
+		return NULL;
+
+	args = args_parse(entry->args.template, argc, (char **)argv);
+	if (!args)
+		return NULL;
+
+	if (entry == &cmd_bind_key_entry || entry == &cmd_unbind_key_entry)
+		key = key_cmd_key(entry, args, flags);
+	else if (args->argc > 0)
+		key = option_cmd_key(entry, args, flags);
+
+	args_free(args);
+	return key;
+}
+
+static bool saved_cmd_replaces(const char *key, int flags, const char *old_key)
+{
+	if (!old_key)
+		return false;
+	if (flags & SAVED_TMUX_CMD_PREFIX)
+		return !strncmp(old_key, key, strlen(key));
+	return !strcmp(old_key, key);
+}
+
+static void free_saved_cmd(struct tmate_session *session, unsigned int i)
+{
+	cmd_free_argv(sc->cmds[i].argc, sc->cmds[i].argv);
+	free(sc->cmds[i].key);
+}
+
+/*
+ * The journal is kept compacted: a command setting an option or a key
+ * binding replaces the previous ones doing the same, so that replaying
+ * it is proportional to the state, not to its history.
+ */
+static void compact_saved_cmds(struct tmate_session *session,
+			       const char *key, int flags)
+{
+	unsigned int i, j;
+
+	if (flags & SAVED_TMUX_CMD_KEEP)
+		return;
+
+	for (i = 0, j = 0; i < sc->tail; i++) {
+		if (saved_cmd_replaces(key, flags, sc->cmds[i].key)) {
+			free_saved_cmd(session, i);
+			continue;
+		}
+		sc->cmds[j++] = sc->cmds[i];
+	}
+	sc->tail = j;
+}
+
 static void append_saved_cmd(struct tmate_session *session,
 			     int argc, const char **argv)
 {
+	char *key;
+	int flags;
+
 	if (!sc->cmds) {
 		sc->capacity = SAVED_TMUX_CMD_INITIAL_SIZE;
 		sc->cmds = xmalloc(sizeof(*sc->cmds) * sc->capacity);
 		sc->tail = 0;
 	}
 
+	key = saved_cmd_key(argc, argv, &flags);
+	if (key)
+		compact_saved_cmds(session, key, flags);
+
 	if (sc->tail == sc->capacity) {
 		sc->capacity *= 2;
 		sc->cmds = xrealloc(sc->cmds, sizeof(*sc->cmds) * sc->capacity);
@@ -189,6 +759,7 @@ static void append_saved_cmd(struct tmate_session *session,
 
 	sc->cmds[sc->tail].argc = argc;
 	sc->cmds[sc->tail].argv = cmd_copy_argv(argc, (char **)argv);
+	sc->cmds[sc->tail].key = key;
 
 	sc->tail++;
 }
@@ -243,8 +814,7 @@ static void __tmate_exec_cmd_args(int argc, const char **argv)
 {
 	int i;
 
-	pack(array, argc + 1);
-	pack(int, TMATE_OUT_EXEC_CMD);
+	pack_message(argc + 1, TMATE_OUT_EXEC_CMD);
 
 	for (i = 0; i < argc; i++)
 		pack(string, argv[i]);
@@ -276,8 +846,7 @@ void tmate_exec_cmd(struct cmd *cmd)
 
 void tmate_failed_cmd(int client_id, const char *cause)
 {
-	pack(array, 3);
-	pack(int, TMATE_OUT_FAILED_CMD);
+	pack_message(3, TMATE_OUT_FAILED_CMD);
 	pack(int, client_id);
 	pack(string, cause);
 }
@@ -290,8 +859,7 @@ void tmate_status(const char *left, const char *right)
 	    old_right && !strcmp(old_right, right))
 		return;
 
-	pack(array, 3);
-	pack(int, TMATE_OUT_STATUS);
+	pack_message(3, TMATE_OUT_STATUS);
 	pack(string, left);
 	pack(string, right);
 
@@ -305,8 +873,7 @@ void tmate_sync_copy_mode(struct window_pane *wp)
 {
 	struct window_copy_mode_data *data = wp->modedata;
 
-	pack(array, 3);
-	pack(int, TMATE_OUT_SYNC_COPY_MODE);
+	pack_message(3, TMATE_OUT_SYNC_COPY_MODE);
 
 	pack(int, wp->id);
 
@@ -342,55 +909,68 @@ void tmate_sync_copy_mode(struct window_pane *wp)
 
 void tmate_write_copy_mode(struct window_pane *wp, const char *str)
 {
-	pack(array, 3);
-	pack(int, TMATE_OUT_WRITE_COPY_MODE);
+	pack_message(3, TMATE_OUT_WRITE_COPY_MODE);
 	pack(int, wp->id);
 	pack(string, str);
 }
 
 void tmate_write_fin(void)
 {
-	pack(array, 1);
-	pack(int, TMATE_OUT_FIN);
+	pack_message(1, TMATE_OUT_FIN);
+}
+
+#define RECONNECTION_MAX_HISTORY_LINE 300
+
+#define grid_num_lines(grid) (grid->hsize + grid->sy)
+
+static unsigned int snapshot_first_line(struct grid *grid,
+					unsigned int max_history_lines)
+{
+	unsigned int max_lines = max_history_lines + grid->sy;
+
+	if (grid_num_lines(grid) > max_lines)
+		return grid_num_lines(grid) - max_lines;
+	return 0;
 }
 
 static void do_snapshot_grid(struct grid *grid, unsigned int max_history_lines)
 {
-	struct grid_line *line;
+	const struct grid_line *line;
+	const struct grid_cell_entry *gce;
+	const struct grid_cell *gcp;
 	struct grid_cell gc;
 	unsigned int line_i, i;
-	unsigned int max_lines;
 	size_t str_len;
 
-	max_lines = max_history_lines + grid->sy;
-
-#define grid_num_lines(grid) (grid->hsize + grid->sy)
-
-	if (grid_num_lines(grid) > max_lines)
-		line_i = grid_num_lines(grid) - max_lines;
-	else
-		line_i = 0;
+	line_i = snapshot_first_line(grid, max_history_lines);
 
 	pack(array, grid_num_lines(grid) - line_i);
 	for (; line_i < grid_num_lines(grid); line_i++) {
-		line = &grid->linedata[line_i];
+		line = grid_peek_line(grid, line_i);
 
 		pack(array, 2);
 		str_len = 0;
 		for (i = 0; i < line->cellsize; i++) {
-			grid_get_cell(grid, i, line_i, &gc);
-			str_len += gc.data.size;
+			grid_peek_cell(line, i, &gcp);
+			str_len += gcp ? gcp->data.size : 1;
 		}
 
 		pack(str, str_len);
 		for (i = 0; i < line->cellsize; i++) {
-			grid_get_cell(grid, i, line_i, &gc);
-			pack(str_body, gc.data.data, gc.data.size);
+			gce = grid_peek_cell(line, i, &gcp);
+			if (gcp)
+				pack(str_body, gcp->data.data, gcp->data.size);
+			else
+				pack(str_body, &gce->data.data, 1);
 		}
 
 		pack(array, line->cellsize);
 		for (i = 0; i < line->cellsize; i++) {
-			grid_get_cell(grid, i, line_i, &gc);
+			gce = grid_peek_cell(line, i, &gcp);
+			if (gcp)
+				memcpy(&gc, gcp, sizeof(gc));
+			else
+				grid_entry_get_cell(gce, &gc);
 			pack(unsigned_int, ((gc.flags << 24) |
 					    (gc.attr  << 16) |
 					    (gc.bg    << 8)  |
@@ -400,9 +980,116 @@ static void do_snapshot_grid(struct grid *grid, unsigned int max_history_lines)
 
 }
 
+/*
+ * Run-length encoded snapshot: each line is walked once, and cells sharing
+ * the same style are sent as a single run. RGB colours are sent in full.
+ */
+
+struct snapshot_run {
+	unsigned int count;
+	unsigned int attr;
+	unsigned int fg;
+	unsigned int bg;
+};
+
+static unsigned int snapshot_colour(int rgb, u_char colour,
+				    const struct grid_cell_rgb *c)
+{
+	if (rgb)
+		return (c->r << 16) | (c->g << 8) | c->b;
+	return colour;
+}
+
+static void do_snapshot_grid_rle(struct grid *grid,
+				 unsigned int max_history_lines)
+{
+	const struct grid_line *line;
+	const struct grid_cell_entry *gce;
+	const struct grid_cell *gcp;
+	struct snapshot_run run, *runs = NULL;
+	char *str = NULL;
+	unsigned int line_i, i, num_runs, max_cells = 0;
+	size_t str_len;
+
+	line_i = snapshot_first_line(grid, max_history_lines);
+
+	pack(array, grid_num_lines(grid) - line_i);
+	for (; line_i < grid_num_lines(grid); line_i++) {
+		line = grid_peek_line(grid, line_i);
+
+		if (line->cellsize > max_cells) {
+			max_cells = line->cellsize;
+			str = xreallocarray(str, max_cells, UTF8_SIZE);
+			runs = xreallocarray(runs, max_cells, sizeof(*runs));
+		}
+
+		str_len = 0;
+		num_runs = 0;
+		for (i = 0; i < line->cellsize; i++) {
+			gce = grid_peek_cell(line, i, &gcp);
+
+			run.count = 1;
+			if (gcp) {
+				memcpy(&str[str_len], gcp->data.data,
+				       gcp->data.size);
+				str_len += gcp->data.size;
+
+				run.attr = ((gcp->flags & ~GRID_FLAG_EXTENDED) << 8) |
+					   gcp->attr;
+				run.fg = snapshot_colour(gcp->flags & GRID_FLAG_FGRGB,
+							 gcp->fg, &gcp->fg_rgb);
+				run.bg = snapshot_colour(gcp->flags & GRID_FLAG_BGRGB,
+							 gcp->bg, &gcp->bg_rgb);
+			} else {
+				/* Not extended: one ASCII byte, no RGB. */
+				str[str_len++] = gce->data.data;
+
+				run.attr = ((gce->flags & ~GRID_FLAG_EXTENDED) << 8) |
+					   gce->data.attr;
+				run.fg = gce->data.fg;
+				run.bg = gce->data.bg;
+			}
+
+			if (num_runs &&
+			    runs[num_runs-1].attr == run.attr &&
+			    runs[num_runs-1].fg == run.fg &&
+			    runs[num_runs-1].bg == run.bg)
+				runs[num_runs-1].count++;
+			else
+				runs[num_runs++] = run;
+		}
+
+		pack(array, 2);
+		pack(str, str_len);
+		pack(str_body, str, str_len);
+
+		pack(array, num_runs * 4);
+		for (i = 0; i < num_runs; i++) {
+			pack(unsigned_int, runs[i].count);
+			pack(unsigned_int, runs[i].attr);
+			pack(unsigned_int, runs[i].fg);
+			pack(unsigned_int, runs[i].bg);
+		}
+	}
+
+	free(str);
+	free(runs);
+}
+
+static bool can_send_rle_snapshot(void)
+{
+	return tmate_session.daemon_protocol_version >= TMATE_PROTOCOL_SNAPSHOT_RLE;
+}
+
 static void do_snapshot_pane(struct window_pane *wp, unsigned int max_history_lines)
 {
 	struct screen *screen = &wp->base;
+	void (*snapshot_grid)(struct grid *, unsigned int);
+
+	if (can_send_rle_snapshot())
+		snapshot_grid = do_snapshot_grid_rle;
+	else
+		snapshot_grid = do_snapshot_grid;
 
 	pack(array, 4);
 	pack(int, wp->id);
@@ -412,18 +1099,27 @@ static void do_snapshot_pane(struct window_pane *wp, unsigned int max_history_li
 	pack(array, 3);
 	pack(int, screen->cx);
 	pack(int, screen->cy);
-	do_snapshot_grid(screen->grid, max_history_lines);
+	grid_reflow_finish(screen->grid);
+	snapshot_grid(screen->grid, max_history_lines);
 
 	if (wp->saved_grid) {
 		pack(array, 3);
 		pack(int, wp->saved_cx);
 		pack(int, wp->saved_cy);
-		do_snapshot_grid(wp->saved_grid, max_history_lines);
+		snapshot_grid(wp->saved_grid, max_history_lines);
 	} else {
 		pack(nil);
 	}
 }
 
+static void pack_snapshot_message(void)
+{
+	if (can_send_rle_snapshot())
+		pack_message(2, TMATE_OUT_SNAPSHOT_RLE);
+	else
+		pack_message(2, TMATE_OUT_SNAPSHOT);
+}
+
 static void tmate_send_session_snapshot(unsigned int max_history_lines)
 {
 	struct session *s;
@@ -432,8 +1128,7 @@ static void tmate_send_session_snapshot(unsigned int max_history_lines)
 	struct window_pane *pane;
 	int num_panes;
 
-	pack(array, 2);
-	pack(int, TMATE_OUT_SNAPSHOT);
+	pack_snapshot_message();
 
 	s = RB_MIN(sessions, &sessions);
 	if (!s)
@@ -460,31 +1155,159 @@ static void tmate_send_session_snapshot(unsigned int max_history_lines)
 	}
 }
 
+void tmate_recover_dropped_pty_data(void)
+{
+	struct tmate_encoder *encoder = &tmate_session.encoder;
+	struct window_pane *wp;
+
+	if (!tmate_session.dropped_pty_panes ||
+	    tmate_encoder_backlog(encoder) > encoder->low_watermark)
+		return;
+
+	pack_snapshot_message();
+	pack(array, tmate_session.dropped_pty_panes);
+	RB_FOREACH(wp, window_pane_tree, &all_window_panes) {
+		if (!wp->tmate_pty_dropped)
+			continue;
+		do_snapshot_pane(wp, RECONNECTION_MAX_HISTORY_LINE);
+		wp->tmate_pty_dropped = 0;
+	}
+
+	tmate_session.dropped_pty_panes = 0;
+	tmate_session.pty_recoveries++;
+}
+
 static void tmate_send_reconnection_data(struct tmate_session *session)
 {
 	if (!session->reconnection_data)
 		return;
 
-	pack(array, 2);
-	pack(int, TMATE_OUT_RECONNECT);
+	pack_message(2, TMATE_OUT_RECONNECT);
 	pack(string, session->reconnection_data);
 }
 
-#define RECONNECTION_MAX_HISTORY_LINE 300
+static void send_session_state(struct tmate_session *session)
+{
+	replay_saved_cmd(session);
+	/* TODO send all option variables */
+	tmate_write_uname();
+	tmate_write_ready();
+
+	tmate_sync_full_layout();
+	tmate_send_session_snapshot(RECONNECTION_MAX_HISTORY_LINE);
+}
+
+static bool can_resume(struct tmate_session *session)
+{
+	return session->daemon_protocol_version >= TMATE_PROTOCOL_RESUME;
+}
+
+/*
+ * Sends the full state instead of resuming. What was recorded while holding
+ * is superseded by it.
+ */
+static void resync_session(struct tmate_session *session)
+{
+	struct tmate_encoder *encoder = &session->encoder;
+
+	tmate_encoder_reset_replay(encoder);
+	drop_all_pty_data();
+
+	tmate_encoder_set_recording(encoder, false);
+	pack_message(2, TMATE_OUT_RESYNC);
+	pack(uint64, encoder->next_seq);
+	tmate_encoder_set_recording(encoder, true);
+
+	send_session_state(session);
+	session->replay_resyncs++;
+}
+
+static void on_resume_timeout(__unused evutil_socket_t fd,
+			      __unused short what, void *arg)
+{
+	struct tmate_session *session = arg;
+
+	if (!session->encoder.holding)
+		return;
+
+	tmate_debug("No resume answer in %d seconds, resyncing",
+		    TMATE_RESUME_TIMEOUT);
+	resync_session(session);
+}
+
+void tmate_stop_resume(struct tmate_session *session)
+{
+	if (session->ev_resume_timeout)
+		evtimer_del(session->ev_resume_timeout);
+}
+
+/*
+ * Asks the daemon where it stopped receiving. Until it answers with
+ * TMATE_IN_RESUME, new messages are only recorded. If it doesn't answer in
+ * time, the full state is sent instead.
+ */
+static void start_resume(struct tmate_session *session)
+{
+	struct tmate_encoder *encoder = &session->encoder;
+	struct timeval tv = { .tv_sec = TMATE_RESUME_TIMEOUT, .tv_usec = 0 };
+
+	flush_all_pty_data(TMATE_PTY_FLUSH_ORDER);
+	tmate_encoder_hold(encoder);
+
+	tmate_encoder_set_recording(encoder, false);
+	tmate_write_header();
+	tmate_send_reconnection_data(session);
+	pack_message(3, TMATE_OUT_RESUME);
+	pack(uint64, encoder->replay_first_seq);
+	pack(uint64, encoder->next_seq);
+	tmate_encoder_set_recording(encoder, true);
+
+	if (!session->ev_resume_timeout) {
+		session->ev_resume_timeout = evtimer_new(session->ev_base,
+							 on_resume_timeout,
+							 session);
+		if (!session->ev_resume_timeout)
+			tmate_fatal("out of memory");
+	}
+	evtimer_add(session->ev_resume_timeout, &tv);
+}
 
 void tmate_send_reconnection_state(struct tmate_session *session)
 {
-	/* Start with a fresh encoder */
+	struct tmate_encoder_stat stats[TMATE_ENCODER_MAX_MSG_TYPES];
+
+	if (can_resume(session)) {
+		start_resume(session);
+		return;
+	}
+
+	/* Start with a fresh encoder, but keep the statistics */
+	memcpy(stats, session->encoder.stats, sizeof(stats));
 	tmate_encoder_destroy(&session->encoder);
 	tmate_encoder_init(&session->encoder, NULL, session);
+	memcpy(session->encoder.stats, stats, sizeof(stats));
+
+	/* The snapshot covers any pty data we were holding on to */
+	drop_all_pty_data();
 
 	tmate_write_header();
 	tmate_send_reconnection_data(session);
-	replay_saved_cmd(session);
-	/* TODO send all option variables */
-	tmate_write_uname();
-	tmate_write_ready();
+	send_session_state(session);
+}
 
-	tmate_sync_layout();
-	tmate_send_session_snapshot(RECONNECTION_MAX_HISTORY_LINE);
+void tmate_resume_session(struct tmate_session *session, int64_t seq)
+{
+	struct tmate_encoder *encoder = &session->encoder;
+
+	if (!encoder->holding)
+		return;
+	tmate_stop_resume(session);
+
+	if (tmate_encoder_resume(encoder, seq) == 0) {
+		session->replay_resumes++;
+		return;
+	}
+
+	/* The daemon missed messages we no longer have. */
+	resync_session(session);
 }
@@ -33,4 +33,7 @@ void tmate_format(struct format_tree *ft)
 	TAILQ_FOREACH(tmate_env, &tmate_env_list, entry) {
 		format_add(ft, tmate_env->name, "%s", tmate_env->value);
 	}
+
+	format_add(ft, "tmate_saved_commands", "%u",
+		   tmate_session.saved_tmux_cmds.tail);
 }
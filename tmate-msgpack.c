@@ -1,12 +1,221 @@
 #include "tmate.h"
 #include "tmate-protocol.h"
 
+/*
+ * Staged data larger than this is handed over to the evbuffer by reference
+ * instead of being copied (a full snapshot typically).
+ */
+#define TMATE_ENCODER_REF_SIZE (64*1024)
+
+static void account_msg(struct tmate_encoder *encoder)
+{
+	struct tmate_encoder_stat *stat;
+
+	if (encoder->msg_type < 0 ||
+	    encoder->msg_type >= TMATE_ENCODER_MAX_MSG_TYPES)
+		return;
+
+	stat = &encoder->stats[encoder->msg_type];
+	stat->msgs++;
+	stat->bytes += encoder->sbuf.size - encoder->msg_start;
+
+	encoder->msg_type = -1;
+}
+
+static void free_staged_data(__unused const void *data, __unused size_t len,
+			     void *arg)
+{
+	free(arg);
+}
+
+/* Where the next byte packed will be in the recorded stream */
+static uint64_t stream_pos(struct tmate_encoder *encoder)
+{
+	return encoder->stream_len + encoder->sbuf.size;
+}
+
+/*
+ * Drops the oldest message of the ring. stream_end is where the stream ends,
+ * which is past the staged data unless it is already counted in stream_len.
+ */
+static void drop_replay_msg(struct tmate_encoder *encoder, uint64_t stream_end)
+{
+	uint64_t end, in_ring_end;
+
+	encoder->replay_first_seq++;
+	if (encoder->replay_first_seq == encoder->next_seq)
+		end = stream_end;
+	else
+		end = encoder->replay_offsets[encoder->replay_first_seq %
+					      TMATE_REPLAY_MAX_MSGS];
+
+	/* The end of the message may still be staged */
+	in_ring_end = end < encoder->stream_len ? end : encoder->stream_len;
+	if (encoder->replay_base < in_ring_end)
+		evbuffer_drain(encoder->replay, in_ring_end - encoder->replay_base);
+	encoder->replay_base = end;
+}
+
+static void new_replay_msg(struct tmate_encoder *encoder)
+{
+	if (encoder->next_seq - encoder->replay_first_seq == TMATE_REPLAY_MAX_MSGS)
+		drop_replay_msg(encoder, stream_pos(encoder));
+
+	encoder->replay_offsets[encoder->next_seq % TMATE_REPLAY_MAX_MSGS] =
+		stream_pos(encoder);
+	encoder->next_seq++;
+}
+
+static void record_replay(struct tmate_encoder *encoder,
+			  const char *data, size_t len)
+{
+	uint64_t start = encoder->stream_len;
+	size_t skip = 0;
+
+	encoder->stream_len += len;
+
+	/* Skip the beginning of a message already dropped from the ring */
+	if (encoder->replay_base >= encoder->stream_len)
+		return;
+	if (encoder->replay_base > start)
+		skip = encoder->replay_base - start;
+
+	if (evbuffer_add(encoder->replay, data + skip, len - skip) < 0)
+		tmate_fatal("Cannot buffer encoded data");
+
+	/* The staged data being recorded is now part of stream_len */
+	while (evbuffer_get_length(encoder->replay) > TMATE_REPLAY_MAX_SIZE &&
+	       encoder->replay_first_seq < encoder->next_seq)
+		drop_replay_msg(encoder, encoder->stream_len);
+}
+
+void tmate_encoder_commit(struct tmate_encoder *encoder)
+{
+	size_t len = encoder->sbuf.size;
+	char *data;
+
+	account_msg(encoder);
+	encoder->msg_start = 0;
+
+	if (!len)
+		return;
+
+	if (encoder->recording) {
+		record_replay(encoder, encoder->sbuf.data, len);
+		if (encoder->holding) {
+			msgpack_sbuffer_clear(&encoder->sbuf);
+			return;
+		}
+	}
+
+	if (len >= TMATE_ENCODER_REF_SIZE) {
+		data = msgpack_sbuffer_release(&encoder->sbuf);
+		if (evbuffer_add_reference(encoder->buffer, data, len,
+					   free_staged_data, data) < 0)
+			tmate_fatal("Cannot buffer encoded data");
+		return;
+	}
+
+	if (evbuffer_add(encoder->buffer, encoder->sbuf.data, len) < 0)
+		tmate_fatal("Cannot buffer encoded data");
+	msgpack_sbuffer_clear(&encoder->sbuf);
+}
+
+size_t tmate_encoder_backlog(struct tmate_encoder *encoder)
+{
+	return evbuffer_get_length(encoder->buffer) + encoder->sbuf.size;
+}
+
+static void schedule_ready_callback(struct tmate_encoder *encoder)
+{
+	if (!encoder->ev_active) {
+		event_active(encoder->ev_buffer, EV_READ, 0);
+		encoder->ev_active = true;
+	}
+}
+
+/*
+ * Messages packed while not recording are not numbered, and go out even
+ * when holding. This is for the handshake of a new connection.
+ */
+void tmate_encoder_set_recording(struct tmate_encoder *encoder, bool recording)
+{
+	tmate_encoder_commit(encoder);
+	encoder->recording = recording;
+}
+
+/*
+ * Stops sending until tmate_encoder_resume() or tmate_encoder_reset_replay()
+ * is called. What was not sent on the previous connection is discarded, it
+ * is in the replay ring.
+ */
+void tmate_encoder_hold(struct tmate_encoder *encoder)
+{
+	tmate_encoder_commit(encoder);
+	evbuffer_drain(encoder->buffer, evbuffer_get_length(encoder->buffer));
+	encoder->holding = true;
+}
+
+/*
+ * Resends the messages from seq, and sends again. Returns -1 if the ring
+ * no longer has message seq, in which case the encoder is still holding.
+ */
+int tmate_encoder_resume(struct tmate_encoder *encoder, int64_t seq)
+{
+	uint64_t start;
+	unsigned char *data;
+	size_t len;
+
+	tmate_encoder_commit(encoder);
+
+	if (seq < 0 || (uint64_t)seq < encoder->replay_first_seq ||
+	    (uint64_t)seq > encoder->next_seq)
+		return -1;
+
+	if ((uint64_t)seq == encoder->next_seq)
+		start = encoder->stream_len;
+	else
+		start = encoder->replay_offsets[seq % TMATE_REPLAY_MAX_MSGS];
+	if (start < encoder->replay_base)
+		return -1;
+
+	len = encoder->stream_len - start;
+	if (len) {
+		data = evbuffer_pullup(encoder->replay, -1);
+		if (evbuffer_add(encoder->buffer,
+				 data + (start - encoder->replay_base), len) < 0)
+			tmate_fatal("Cannot buffer encoded data");
+	}
+	tmate_session.replay_bytes += len;
+
+	encoder->holding = false;
+	schedule_ready_callback(encoder);
+	return 0;
+}
+
+/*
+ * Forgets about the recorded messages, and sends again. The next message
+ * keeps its number.
+ */
+void tmate_encoder_reset_replay(struct tmate_encoder *encoder)
+{
+	tmate_encoder_commit(encoder);
+
+	evbuffer_drain(encoder->replay, evbuffer_get_length(encoder->replay));
+	encoder->replay_first_seq = encoder->next_seq;
+	encoder->replay_base = encoder->stream_len;
+
+	encoder->holding = false;
+	schedule_ready_callback(encoder);
+}
+
 static void on_encoder_buffer_ready(__unused evutil_socket_t fd,
 				    __unused short what, void *arg)
 {
 	struct tmate_encoder *encoder = arg;
 
 	encoder->ev_active = false;
+	tmate_encoder_commit(encoder);
 	if (encoder->ready_callback)
 		encoder->ready_callback(encoder->userdata, encoder->buffer);
 }
@@ -15,14 +224,10 @@ static int on_encoder_write(void *userdata, const char *buf, size_t len)
 {
 	struct tmate_encoder *encoder = userdata;
 
-	if (evbuffer_add(encoder->buffer, buf, len) < 0)
+	if (msgpack_sbuffer_write(&encoder->sbuf, buf, len) < 0)
 		tmate_fatal("Cannot buffer encoded data");
 
-	if (!encoder->ev_active) {
-		event_active(encoder->ev_buffer, EV_READ, 0);
-		encoder->ev_active = true;
-	}
-
+	schedule_ready_callback(encoder);
 	return 0;
 }
 
@@ -45,16 +250,49 @@ void msgpack_pack_boolean(msgpack_packer *pk, bool value)
 		msgpack_pack_false(pk);
 }
 
+/*
+ * Starts a new message of the given type. size is the size of the message
+ * array, including the type itself.
+ */
+void msgpack_pack_message(msgpack_packer *pk, unsigned int size, int type)
+{
+	struct tmate_encoder *encoder = tmate_encoder_from_pk(pk);
+
+	account_msg(encoder);
+	encoder->msg_type = type;
+	encoder->msg_start = encoder->sbuf.size;
+	if (encoder->recording)
+		new_replay_msg(encoder);
+
+	msgpack_pack_array(pk, size);
+	msgpack_pack_int(pk, type);
+}
+
 void tmate_encoder_init(struct tmate_encoder *encoder,
 			tmate_encoder_write_cb *callback,
 			void *userdata)
 {
 	msgpack_packer_init(&encoder->pk, encoder, &on_encoder_write);
+	msgpack_sbuffer_init(&encoder->sbuf);
+	encoder->msg_type = -1;
+	encoder->msg_start = 0;
+	memset(encoder->stats, 0, sizeof(encoder->stats));
+	encoder->high_watermark = TMATE_ENCODER_HIGH_WATERMARK;
+	encoder->low_watermark = TMATE_ENCODER_LOW_WATERMARK;
+
+	encoder->recording = true;
+	encoder->holding = false;
+	encoder->replay = evbuffer_new();
+	encoder->replay_base = 0;
+	encoder->stream_len = 0;
+	encoder->replay_first_seq = 0;
+	encoder->next_seq = 0;
+
 	encoder->buffer = evbuffer_new();
 	encoder->ready_callback = callback;
 	encoder->userdata = userdata;
 
-	if (!encoder->buffer)
+	if (!encoder->buffer || !encoder->replay)
 		tmate_fatal("Can't allocate buffer");
 
 	encoder->ev_buffer = event_new(tmate_session.ev_base, -1,
@@ -70,7 +308,9 @@ void tmate_encoder_init(struct tmate_encoder *encoder,
 void tmate_encoder_destroy(struct tmate_encoder *encoder)
 {
 	/* encoder->pk doesn't need any cleanup */
+	msgpack_sbuffer_destroy(&encoder->sbuf);
 	evbuffer_free(encoder->buffer);
+	evbuffer_free(encoder->replay);
 	event_del(encoder->ev_buffer);
 	event_free(encoder->ev_buffer);
 	memset(encoder, 0, sizeof(*encoder));
@@ -82,6 +322,7 @@ void tmate_encoder_set_ready_callback(struct tmate_encoder *encoder,
 {
 	encoder->ready_callback = callback;
 	encoder->userdata = userdata;
+	tmate_encoder_commit(encoder);
 	if (encoder->ready_callback)
 		encoder->ready_callback(encoder->userdata, encoder->buffer);
 }
@@ -57,6 +57,20 @@ enum tmate_daemon_out_msg_types {
 	TMATE_OUT_SNAPSHOT,
 	TMATE_OUT_EXEC_CMD,
 	TMATE_OUT_UNAME,
+	TMATE_OUT_SYNC_LAYOUT_DELTA,
+	TMATE_OUT_SNAPSHOT_RLE,
+	TMATE_OUT_RESUME,
+	TMATE_OUT_RESYNC,
+};
+
+enum tmate_layout_ops {
+	TMATE_LAYOUT_SIZE,
+	TMATE_LAYOUT_WINDOW_ADD,
+	TMATE_LAYOUT_WINDOW_REMOVE,
+	TMATE_LAYOUT_WINDOW_RENAME,
+	TMATE_LAYOUT_WINDOW_PANES,
+	TMATE_LAYOUT_ACTIVE_PANE,
+	TMATE_LAYOUT_ACTIVE_WINDOW,
 };
 
 /*
@@ -77,9 +91,47 @@ enum tmate_daemon_out_msg_types {
 [TMATE_OUT_READY]
 [TMATE_OUT_RECONNECT, string: reconnection_data]
 [TMATE_OUT_SNAPSHOT, ...]
+	// Also sent for the panes which output was dropped because the
+	// uplink could not keep up. It then only contains these panes.
 [TMATE_OUT_EXEC_CMD, string: cmd_name, ...string: args]
 [TMATE_OUT_UNAME, string: name.sysname, string: name.nodename,
                   string: name.release, string: name.version, string: name.machine]
+[TMATE_OUT_SYNC_LAYOUT_DELTA, [[int: layout_op, ...], ...]]
+	// Only sent when the daemon protocol version is >= 7, and after a
+	// TMATE_OUT_SYNC_LAYOUT. Operations apply to the last layout sent.
+
+[TMATE_OUT_SNAPSHOT_RLE, [[int: pane_id, int: mode,
+			   [int: cur_x, int: cur_y, grid],
+			   [int: saved_cx, int: saved_cy, grid] | nil], ...]]
+	// Only sent when the daemon protocol version is >= 7, in place of
+	// TMATE_OUT_SNAPSHOT.
+	// grid: [[string: line_utf8, [int: num_cells, int: (flags << 8) | attr,
+	//                             int: fg, int: bg, ...]], ...]
+	// fg (bg) is 0xRRGGBB when flags has GRID_FLAG_FGRGB (GRID_FLAG_BGRGB).
+
+[TMATE_OUT_RESUME, int: first_seq, int: next_seq]
+	// Sent after the header when reconnecting to a daemon with protocol
+	// version >= 8, in place of the session state. Messages are numbered
+	// from 0 (the header of the first connection). The client can resend
+	// messages first_seq to next_seq - 1, and sends nothing else until
+	// it gets a TMATE_IN_RESUME. TMATE_OUT_HEADER, TMATE_OUT_RECONNECT,
+	// TMATE_OUT_RESUME and TMATE_OUT_RESYNC are not numbered when sent
+	// on reconnection.
+[TMATE_OUT_RESYNC, int: next_seq]
+	// Answers a TMATE_IN_RESUME the client can't serve. The full session
+	// state follows, numbered from next_seq.
+
+[TMATE_LAYOUT_SIZE, int: sx, int: sy]
+[TMATE_LAYOUT_WINDOW_ADD, int: win_id, string: win_name,
+			  [[int: pane_id, int: sx, int: sy, int: xoff, int: yoff], ...],
+			  int: active_pane_id]
+[TMATE_LAYOUT_WINDOW_REMOVE, int: win_id]
+[TMATE_LAYOUT_WINDOW_RENAME, int: win_id, string: win_name]
+[TMATE_LAYOUT_WINDOW_PANES, int: win_id,
+			    [[int: pane_id, int: sx, int: sy, int: xoff, int: yoff], ...],
+			    int: active_pane_id]
+[TMATE_LAYOUT_ACTIVE_PANE, int: win_id, int: active_pane_id]
+[TMATE_LAYOUT_ACTIVE_WINDOW, int: active_win_id]
 */
 
 enum tmate_daemon_in_msg_types {
@@ -91,6 +143,9 @@ enum tmate_daemon_in_msg_types {
 	TMATE_IN_READY,
 	TMATE_IN_PANE_KEY,
 	TMATE_IN_EXEC_CMD,
+	TMATE_IN_HEADER,
+	TMATE_IN_SYNC_LAYOUT,
+	TMATE_IN_RESUME,
 };
 
 /*
@@ -102,6 +157,9 @@ enum tmate_daemon_in_msg_types {
 [TMATE_IN_READY]
 [TMATE_IN_PANE_KEY, int: pane_id, uint64 keycode] // pane_id == -1: active pane
 [TMATE_IN_EXEC_CMD, int: client_id, ...string: args]
+[TMATE_IN_HEADER, int: proto_version]
+[TMATE_IN_SYNC_LAYOUT] // Asks for a full TMATE_OUT_SYNC_LAYOUT
+[TMATE_IN_RESUME, int: seq] // Next message expected, -1: unknown session
 */
 
 #endif
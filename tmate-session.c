@@ -240,6 +240,9 @@ void tmate_reconnect_session(struct tmate_session *session, const char *message)
 	 */
 	struct timeval tv = { .tv_sec = TMATE_RECONNECT_RETRY_TIMEOUT, .tv_usec = 0 };
 
+	/* A resume still waiting for its answer is started again. */
+	tmate_stop_resume(session);
+
 	if (session->ev_connection_retry)
 		return;
 
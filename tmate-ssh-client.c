@@ -2,8 +2,10 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <event.h>
 #include <assert.h>
 
@@ -18,59 +20,345 @@ static void printflike(2, 3) kill_ssh_client(struct tmate_ssh_client *client,
 static void printflike(2, 3) kill_ssh_client(struct tmate_ssh_client *client,
 						  const char *fmt, ...);
 
-static void read_channel(struct tmate_ssh_client *client)
+/*
+ * The network thread. Once the connection is established, it owns the ssh
+ * session so that encryption and compression don't slow down the main loop.
+ */
+
+#define TMATE_NET_CHUNK_SIZE (16*1024)
+#define TMATE_NET_MAX_INFLIGHT (1024*1024)
+
+struct tmate_net_chunk {
+	size_t len;
+	char data[];
+};
+
+static bool ring_full(struct tmate_net_ring *ring)
 {
-	struct tmate_decoder *decoder = &client->tmate_session->decoder;
-	char *buf;
-	ssize_t len;
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	return ring->tail - head == TMATE_NET_RING_SIZE;
+}
+
+static bool ring_push(struct tmate_net_ring *ring, void *ptr)
+{
+	if (ring_full(ring))
+		return false;
+
+	ring->slots[ring->tail % TMATE_NET_RING_SIZE] = ptr;
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void *ring_pop(struct tmate_net_ring *ring)
+{
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	void *ptr;
+
+	if (ring->head == tail)
+		return NULL;
+
+	ptr = ring->slots[ring->head % TMATE_NET_RING_SIZE];
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+	return ptr;
+}
+
+static void wake(int fd)
+{
+	char c = 0;
+
+	/* If the pipe is full, a wake up is already pending */
+	(void)write(fd, &c, 1);
+}
+
+static void drain_wake(int fd)
+{
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+/*
+ * The x*alloc functions call fatal(), which is only safe on the main thread:
+ * the network thread uses plain allocations, and reports failures instead.
+ */
+static void net_thread_fail(struct tmate_ssh_client *client, const char *what)
+{
+	if (asprintf(&client->net_error, "%s: %s", what,
+		     ssh_get_error(client->session)) < 0)
+		client->net_error = NULL;
+	__atomic_store_n(&client->net_failed, 1, __ATOMIC_RELEASE);
+	wake(client->main_wake[1]);
+}
+
+static int net_thread_write(struct tmate_ssh_client *client)
+{
+	struct tmate_net_chunk *chunk;
+	size_t off;
+	int written, notify = 0;
+
+	while ((chunk = ring_pop(&client->out_ring))) {
+		for (off = 0; off < chunk->len; off += written) {
+			written = ssh_channel_write(client->channel,
+						    chunk->data + off,
+						    chunk->len - off);
+			if (written < 0) {
+				free(chunk);
+				net_thread_fail(client, "Error writing to channel");
+				return -1;
+			}
+		}
+
+		__atomic_sub_fetch(&client->net_inflight, chunk->len,
+				   __ATOMIC_RELEASE);
+		free(chunk);
+		notify = 1;
+	}
+
+	/* The main thread may have more to send */
+	if (notify)
+		wake(client->main_wake[1]);
+	return 0;
+}
+
+static int net_thread_read(struct tmate_ssh_client *client)
+{
+	struct tmate_net_chunk *chunk;
+	int len, notify = 0;
+
+	while (!ring_full(&client->in_ring)) {
+		chunk = malloc(sizeof(*chunk) + TMATE_NET_CHUNK_SIZE);
+		if (!chunk) {
+			net_thread_fail(client, "Cannot allocate buffer");
+			return -1;
+		}
+		len = ssh_channel_read_nonblocking(client->channel, chunk->data,
+						   TMATE_NET_CHUNK_SIZE, 0);
+		if (len <= 0) {
+			free(chunk);
+			if (len < 0) {
+				net_thread_fail(client, "Error reading from channel");
+				return -1;
+			}
+			break;
+		}
+
+		chunk->len = len;
+		ring_push(&client->in_ring, chunk);
+		notify = 1;
+	}
+
+	if (notify)
+		wake(client->main_wake[1]);
+	return 0;
+}
+
+static void *net_thread_main(void *arg)
+{
+	struct tmate_ssh_client *client = arg;
+	struct pollfd pfd[2];
+
+	pfd[0].fd = client->net_wake[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ssh_get_fd(client->session);
 
 	for (;;) {
-		tmate_decoder_get_buffer(decoder, &buf, &len);
-		len = ssh_channel_read_nonblocking(client->channel, buf, len, 0);
-		if (len < 0) {
-			kill_ssh_client(client, "Error reading from channel: %s",
-					ssh_get_error(client->session));
+		/* Stop reading when the main thread is behind */
+		pfd[1].events = ring_full(&client->in_ring) ? 0 : POLLIN;
+
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+			net_thread_fail(client, "poll failed");
 			break;
 		}
 
-		if (len == 0)
+		if (__atomic_load_n(&client->net_stop, __ATOMIC_ACQUIRE))
+			break;
+
+		if (pfd[0].revents & POLLIN)
+			drain_wake(client->net_wake[0]);
+
+		if (net_thread_write(client) < 0)
+			break;
+		if (net_thread_read(client) < 0)
 			break;
 
-		tmate_decoder_commit(decoder, len);
+		/*
+		 * Reported even when not polling for input: with a full ring
+		 * there is no progress to wait for, so give up now.
+		 */
+		if (pfd[1].revents & (POLLHUP|POLLERR|POLLNVAL)) {
+			net_thread_fail(client, "Connection closed");
+			break;
+		}
 	}
+
+	return NULL;
 }
 
-static void on_decoder_read(void *userdata, struct tmate_unpacker *uk)
+static void commit_to_decoder(struct tmate_decoder *decoder,
+			      const char *data, size_t len)
 {
-	struct tmate_ssh_client *client = userdata;
-	tmate_dispatch_slave_message(client->tmate_session, uk);
+	char *buf;
+	size_t buf_len;
+
+	while (len > 0) {
+		tmate_decoder_get_buffer(decoder, &buf, &buf_len);
+		if (buf_len > len)
+			buf_len = len;
+		memcpy(buf, data, buf_len);
+		tmate_decoder_commit(decoder, buf_len);
+
+		data += buf_len;
+		len -= buf_len;
+	}
 }
 
 static void on_encoder_write(void *userdata, struct evbuffer *buffer)
 {
 	struct tmate_ssh_client *client = userdata;
-	ssize_t len, written;
-	unsigned char *buf;
+	struct tmate_net_chunk *chunk;
+	size_t len;
+	int queued = 0;
 
-	if (!client->channel)
+	if (!client->net_running)
 		return;
 
-	for(;;) {
-		len = evbuffer_get_length(buffer);
-		if (!len)
+	/*
+	 * What the network thread can't take yet stays in the encoder
+	 * buffer, which is what the encoder watermarks look at.
+	 */
+	while ((len = evbuffer_get_length(buffer))) {
+		if (ring_full(&client->out_ring) ||
+		    __atomic_load_n(&client->net_inflight, __ATOMIC_ACQUIRE) >=
+		    TMATE_NET_MAX_INFLIGHT)
 			break;
 
-		buf = evbuffer_pullup(buffer, -1);
+		if (len > TMATE_NET_CHUNK_SIZE)
+			len = TMATE_NET_CHUNK_SIZE;
 
-		written = ssh_channel_write(client->channel, buf, len);
-		if (written < 0) {
-			kill_ssh_client(client, "Error writing to channel: %s",
-					ssh_get_error(client->session));
-			break;
-		}
+		chunk = xmalloc(sizeof(*chunk) + len);
+		chunk->len = evbuffer_remove(buffer, chunk->data, len);
 
-		evbuffer_drain(buffer, written);
+		__atomic_add_fetch(&client->net_inflight, chunk->len,
+				   __ATOMIC_RELEASE);
+		ring_push(&client->out_ring, chunk);
+		queued = 1;
 	}
+
+	if (queued)
+		wake(client->net_wake[1]);
+
+	tmate_recover_dropped_pty_data();
+}
+
+static void on_net_event(__unused evutil_socket_t fd, __unused short what,
+			 void *arg)
+{
+	struct tmate_ssh_client *client = arg;
+	struct tmate_decoder *decoder = &client->tmate_session->decoder;
+	struct tmate_net_chunk *chunk;
+	int received = 0;
+
+	drain_wake(client->main_wake[0]);
+
+	while ((chunk = ring_pop(&client->in_ring))) {
+		commit_to_decoder(decoder, chunk->data, chunk->len);
+		free(chunk);
+		received = 1;
+	}
+
+	/* The network thread may have stopped reading */
+	if (received)
+		wake(client->net_wake[1]);
+
+	if (__atomic_load_n(&client->net_failed, __ATOMIC_ACQUIRE)) {
+		kill_ssh_client(client, "%s", client->net_error ?
+				client->net_error : "Network thread failed");
+		return;
+	}
+
+	on_encoder_write(client, client->tmate_session->encoder.buffer);
+}
+
+static void make_wake_pipe(int fds[2])
+{
+	if (pipe(fds) != 0)
+		tmate_fatal("pipe failed");
+	setblocking(fds[0], 0);
+	setblocking(fds[1], 0);
+}
+
+static void start_net_thread(struct tmate_ssh_client *client)
+{
+	/* The network thread polls the socket from now on */
+	if (client->ev_ssh) {
+		event_del(client->ev_ssh);
+		event_free(client->ev_ssh);
+		client->ev_ssh = NULL;
+	}
+
+	client->net_stop = 0;
+	client->net_failed = 0;
+	client->net_inflight = 0;
+
+	make_wake_pipe(client->net_wake);
+	make_wake_pipe(client->main_wake);
+
+	client->ev_net = event_new(client->tmate_session->ev_base,
+				   client->main_wake[0], EV_READ | EV_PERSIST,
+				   on_net_event, client);
+	if (!client->ev_net)
+		tmate_fatal("out of memory");
+	event_add(client->ev_net, NULL);
+
+	if (pthread_create(&client->net_thread, NULL, net_thread_main, client) != 0)
+		tmate_fatal("Cannot start the network thread");
+	client->net_running = true;
+}
+
+static void free_ring(struct tmate_net_ring *ring)
+{
+	void *ptr;
+
+	while ((ptr = ring_pop(ring)))
+		free(ptr);
+}
+
+static void stop_net_thread(struct tmate_ssh_client *client)
+{
+	int fd;
+
+	__atomic_store_n(&client->net_stop, 1, __ATOMIC_RELEASE);
+
+	/* Unblock a write stuck on a stalled connection */
+	if ((fd = ssh_get_fd(client->session)) >= 0)
+		shutdown(fd, SHUT_RDWR);
+
+	wake(client->net_wake[1]);
+	pthread_join(client->net_thread, NULL);
+	client->net_running = false;
+
+	event_del(client->ev_net);
+	event_free(client->ev_net);
+	client->ev_net = NULL;
+
+	close(client->net_wake[0]);
+	close(client->net_wake[1]);
+	close(client->main_wake[0]);
+	close(client->main_wake[1]);
+
+	free_ring(&client->out_ring);
+	free_ring(&client->in_ring);
+	client->net_inflight = 0;
+
+	free(client->net_error);
+	client->net_error = NULL;
+}
+
+static void on_decoder_read(void *userdata, struct tmate_unpacker *uk)
+{
+	struct tmate_ssh_client *client = userdata;
+	tmate_dispatch_slave_message(client->tmate_session, uk);
 }
 
 static void on_ssh_auth_server_complete(struct tmate_ssh_client *connected_client)
@@ -474,13 +762,28 @@ SSH_NEW_CHANNEL:
 
 			client->state = SSH_READY;
 
+			/*
+			 * The reconnection state is sent before the daemon
+			 * header. We assume the daemon didn't change if the
+			 * server is the same.
+			 */
+			if (!client->tmate_session->daemon_server_ip ||
+			    strcmp(client->tmate_session->daemon_server_ip,
+				   client->server_ip)) {
+				client->tmate_session->daemon_protocol_version = 0;
+				free(client->tmate_session->daemon_server_ip);
+				client->tmate_session->daemon_server_ip =
+					xstrdup(client->server_ip);
+			}
+
 			if (client->tmate_session->reconnected)
 				tmate_send_reconnection_state(client->tmate_session);
 
-			tmate_encoder_set_ready_callback(&client->tmate_session->encoder,
-							 on_encoder_write, client);
 			tmate_decoder_init(&client->tmate_session->decoder,
 					   on_decoder_read, client);
+			start_net_thread(client);
+			tmate_encoder_set_ready_callback(&client->tmate_session->encoder,
+							 on_encoder_write, client);
 
 			free(client->tmate_session->last_server_ip);
 			client->tmate_session->last_server_ip = xstrdup(client->server_ip);
@@ -488,7 +791,8 @@ SSH_NEW_CHANNEL:
 		// fall through
 
 	case SSH_READY:
-		read_channel(client);
+		/* From now on, I/O happens in the network thread */
+		break;
 	}
 }
 
@@ -522,6 +826,9 @@ static void kill_ssh_client(struct tmate_ssh_client *client,
 		client->ev_ssh = NULL;
 	}
 
+	if (client->net_running)
+		stop_net_thread(client);
+
 	if (client->state == SSH_READY) {
 		tmate_encoder_set_ready_callback(&client->tmate_session->encoder, NULL, NULL);
 		tmate_decoder_destroy(&client->tmate_session->decoder);
@@ -2,6 +2,7 @@
 #define TMATE_H
 
 #include <sys/types.h>
+#include <pthread.h>
 #include <msgpack.h>
 #include <libssh/libssh.h>
 #include <libssh/callbacks.h>
@@ -17,6 +18,22 @@
 
 typedef void tmate_encoder_write_cb(void *userdata, struct evbuffer *buffer);
 
+#define TMATE_ENCODER_MAX_MSG_TYPES 32
+
+/*
+ * Past the high watermark, pane output is dropped and the panes are
+ * snapshotted once the backlog goes under the low watermark.
+ */
+#define TMATE_ENCODER_HIGH_WATERMARK (4*1024*1024)
+#define TMATE_ENCODER_LOW_WATERMARK (256*1024)
+#define TMATE_REPLAY_MAX_MSGS 4096
+#define TMATE_REPLAY_MAX_SIZE (1024*1024)
+
+struct tmate_encoder_stat {
+	unsigned long long msgs;
+	unsigned long long bytes;
+};
+
 struct tmate_encoder {
 	msgpack_packer pk;
 	tmate_encoder_write_cb *ready_callback;
@@ -24,6 +41,35 @@ struct tmate_encoder {
 	struct evbuffer *buffer;
 	struct event *ev_buffer;
 	bool ev_active;
+
+	/*
+	 * Messages are packed in the staging buffer, and moved to the
+	 * evbuffer in one go when the encoder event fires.
+	 */
+	msgpack_sbuffer sbuf;
+	int msg_type;
+	size_t msg_start;
+	struct tmate_encoder_stat stats[TMATE_ENCODER_MAX_MSG_TYPES];
+
+	size_t high_watermark;
+	size_t low_watermark;
+
+	/*
+	 * The replay ring keeps the most recent messages, to resend what the
+	 * daemon missed when resuming after a disconnection. Messages are
+	 * numbered in the order they are packed, from 0 for the header.
+	 * Offsets count the bytes of the recorded stream: the ring holds the
+	 * stream from replay_base, which is where message replay_first_seq
+	 * starts. While holding, messages are recorded but not sent.
+	 */
+	bool recording;
+	bool holding;
+	struct evbuffer *replay;
+	uint64_t replay_base;
+	uint64_t stream_len;
+	uint64_t replay_first_seq;
+	uint64_t next_seq;
+	uint64_t replay_offsets[TMATE_REPLAY_MAX_MSGS];
 };
 
 extern void tmate_encoder_init(struct tmate_encoder *encoder,
@@ -34,8 +80,16 @@ extern void tmate_encoder_set_ready_callback(struct tmate_encoder *encoder,
 					     tmate_encoder_write_cb *callback,
 					     void *userdata);
 
+extern void tmate_encoder_commit(struct tmate_encoder *encoder);
+extern size_t tmate_encoder_backlog(struct tmate_encoder *encoder);
+extern void tmate_encoder_set_recording(struct tmate_encoder *encoder, bool recording);
+extern void tmate_encoder_hold(struct tmate_encoder *encoder);
+extern int tmate_encoder_resume(struct tmate_encoder *encoder, int64_t seq);
+extern void tmate_encoder_reset_replay(struct tmate_encoder *encoder);
+
 extern void msgpack_pack_string(msgpack_packer *pk, const char *str);
 extern void msgpack_pack_boolean(msgpack_packer *pk, bool value);
+extern void msgpack_pack_message(msgpack_packer *pk, unsigned int size, int type);
 
 #define _pack(enc, what, ...) msgpack_pack_##what(&(enc)->pk, ##__VA_ARGS__)
 
@@ -74,7 +128,12 @@ extern void unpack_array(struct tmate_unpacker *uk, struct tmate_unpacker *neste
 
 /* tmate-encoder.c */
 
-#define TMATE_PROTOCOL_VERSION 6
+#define TMATE_PROTOCOL_VERSION 8
+
+/* Minimum daemon protocol version for the following features */
+#define TMATE_PROTOCOL_LAYOUT_DELTA 7
+#define TMATE_PROTOCOL_SNAPSHOT_RLE 7
+#define TMATE_PROTOCOL_RESUME 8
 
 struct tmate_session;
 
@@ -82,7 +141,10 @@ extern void tmate_write_header(void);
 extern void tmate_write_uname(void);
 extern void tmate_write_ready(void);
 extern void tmate_sync_layout(void);
+extern void tmate_sync_full_layout(void);
 extern void tmate_pty_data(struct window_pane *wp, const char *buf, size_t len);
+extern void tmate_pty_data_free(struct window_pane *wp);
+extern void tmate_recover_dropped_pty_data(void);
 extern int tmate_should_replicate_cmd(const struct cmd_entry *cmd);
 extern void tmate_set_val(const char *name, const char *value);
 extern void tmate_exec_cmd_args(int argc, const char **argv);
@@ -93,6 +155,9 @@ extern void tmate_sync_copy_mode(struct window_pane *wp);
 extern void tmate_write_copy_mode(struct window_pane *wp, const char *str);
 extern void tmate_write_fin(void);
 extern void tmate_send_reconnection_state(struct tmate_session *session);
+extern void tmate_resume_session(struct tmate_session *session, int64_t seq);
+extern void tmate_stop_resume(struct tmate_session *session);
+extern const char *tmate_out_msg_name(int type);
 
 /* tmate-decoder.c */
 
@@ -102,6 +167,18 @@ extern void tmate_dispatch_slave_message(struct tmate_session *session,
 
 /* tmate-ssh-client.c */
 
+/*
+ * Single producer, single consumer queue of buffers between the main thread
+ * and the network thread.
+ */
+#define TMATE_NET_RING_SIZE 64
+
+struct tmate_net_ring {
+	void *slots[TMATE_NET_RING_SIZE];
+	unsigned int head;
+	unsigned int tail;
+};
+
 enum tmate_ssh_client_state_types {
 	SSH_NONE,
 	SSH_INIT,
@@ -142,6 +219,24 @@ struct tmate_ssh_client {
 	ssh_channel channel;
 
 	struct event *ev_ssh;
+
+	/*
+	 * Once the connection is ready, the network thread owns the ssh
+	 * session. Encryption, compression and socket I/O happen there, and
+	 * buffers are exchanged through the rings. Each side wakes the other
+	 * with a byte on a pipe.
+	 */
+	bool net_running;
+	pthread_t net_thread;
+	int net_wake[2];
+	int main_wake[2];
+	struct event *ev_net;
+	struct tmate_net_ring out_ring;
+	struct tmate_net_ring in_ring;
+	size_t net_inflight;
+	int net_stop;
+	int net_failed;
+	char *net_error;
 };
 TAILQ_HEAD(tmate_ssh_clients, tmate_ssh_client);
 
@@ -151,6 +246,40 @@ extern struct tmate_ssh_client *tmate_ssh_client_alloc(struct tmate_session *ses
 
 /* tmate-session.c */
 
+enum tmate_pty_flush_reasons {
+	TMATE_PTY_FLUSH_SIZE,
+	TMATE_PTY_FLUSH_DEADLINE,
+	TMATE_PTY_FLUSH_ECHO,
+	TMATE_PTY_FLUSH_ORDER,
+	TMATE_PTY_FLUSH_DESTROY,
+	TMATE_PTY_FLUSH_MAX,
+};
+
+struct tmate_layout_pane {
+	int id;
+	unsigned int sx;
+	unsigned int sy;
+	unsigned int xoff;
+	unsigned int yoff;
+};
+
+struct tmate_layout_window {
+	int idx;
+	char *name;
+	int active_pane_id;
+	unsigned int num_panes;
+	struct tmate_layout_pane *panes;
+};
+
+struct tmate_layout {
+	bool valid;
+	unsigned int sx;
+	unsigned int sy;
+	int active_window_idx;
+	unsigned int num_windows;
+	struct tmate_layout_window *windows;
+};
+
 struct tmate_session {
 	struct event_base *ev_base;
 	struct evdns_base *ev_dnsbase;
@@ -162,6 +291,33 @@ struct tmate_session {
 	/* True when the slave has sent all the environment variables */
 	int tmate_env_ready;
 
+	/*
+	 * Protocol version of the daemon, 0 until it sends its header.
+	 * It is kept when reconnecting to the same server.
+	 */
+	int daemon_protocol_version;
+	char *daemon_server_ip;
+
+	/* Last layout sent, used to send layout deltas */
+	struct tmate_layout last_layout;
+
+	/* Panes with coalesced pty data not sent yet */
+	unsigned int pending_pty_panes;
+	unsigned long long pty_flushes[TMATE_PTY_FLUSH_MAX];
+
+	/* Panes which output was dropped because the uplink is too slow */
+	unsigned int dropped_pty_panes;
+	unsigned long long pty_dropped_bytes;
+	unsigned long long pty_recoveries;
+
+	/* Reconnections served from the replay ring, or with a full resync */
+	unsigned long long replay_resumes;
+	unsigned long long replay_resyncs;
+	unsigned long long replay_bytes;
+
+	/* Resync instead if the daemon doesn't answer a resume */
+	struct event *ev_resume_timeout;
+
 	int min_sx;
 	int min_sy;
 
@@ -182,7 +338,8 @@ struct tmate_session {
 	 * When we reconnect, instead of serializing the key bindings and
 	 * options, we replay all the tmux commands we replicated.
 	 * It may be a little innacurate to replicate the state, but
-	 * it's much easier.
+	 * it's much easier. Commands superseded by later ones are removed,
+	 * key is what the command sets (NULL if it can't be compacted).
 	 */
 	struct {
 		unsigned int capacity;
@@ -190,6 +347,7 @@ struct tmate_session {
 		struct {
 			int argc;
 			char **argv;
+			char *key;
 		} *cmds;
 	} saved_tmux_cmds;
 };
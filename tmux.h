@@ -67,14 +67,27 @@ struct tmuxproc;
 #define NAME_INTERVAL 500000
 
 /*
- * READ_SIZE is the maximum size of data to hold from a pty (the event high
- * watermark). READ_BACKOFF is the amount of data waiting to be output to a tty
- * before pty reads will be backed off. READ_TIME is how long to back off
- * before the next read (in microseconds) if a tty is above READ_BACKOFF.
+ * READ_SIZE is the initial and smallest size of data to hold from a pty (the
+ * event high watermark); it doubles up to READ_SIZE_MAX while a pane fills it
+ * and halves again when reads are small. READ_BACKOFF is the amount of data
+ * waiting to be output to a tty before pty reads will be backed off. READ_TIME
+ * is how long to back off before the next read (in microseconds) if a tty is
+ * above READ_BACKOFF. READ_RATE_TIME is how often the read rate is worked out
+ * (in microseconds).
  */
 #define READ_SIZE 1024
+#define READ_SIZE_MAX 65536
 #define READ_BACKOFF 512
 #define READ_TIME 100
+#define READ_RATE_TIME 1000000
+
+/*
+ * FRAME_SIZE is how much output a pane may produce in one frame (as set by the
+ * frame-rate option) before it is redrawn once a frame rather than each change
+ * being sent to clients. It goes back to normal when a frame has less than a
+ * quarter of this.
+ */
+#define FRAME_SIZE 16384
 
 /* Attribute to make gcc check printf-like arguments. */
 #define printflike(a, b) __attribute__ ((format (printf, a, b)))
@@ -657,6 +670,7 @@ enum utf8_state {
 
 /* Grid line flags. */
 #define GRID_LINE_WRAPPED 0x1
+#define GRID_LINE_COMPRESSED 0x2
 
 /* Grid cell RGB colours. */
 struct grid_cell_rgb {
@@ -694,6 +708,7 @@ struct grid_cell_entry {
 } __packed;
 
 /* Grid line. */
+struct grid_block;
 struct grid_line {
 	u_int			 cellsize;
 	struct grid_cell_entry	*celldata;
@@ -702,12 +717,20 @@ struct grid_line {
 	struct grid_cell	*extddata;
 
 	int			 flags;
+
+	/* Compressed lines have their data in a block. */
+	struct grid_block	*block;
+	u_int			 blockline;
 } __packed;
 
 /* Entire grid of cells. */
+struct grid_arena;
+struct grid_file;
+struct grid_reflow;
 struct grid {
 	int			 flags;
 #define GRID_HISTORY 0x1 /* scroll lines into history */
+#define GRID_HISTORY_FILE 0x2 /* keep old history in a file */
 
 	u_int			 sx;
 	u_int			 sy;
@@ -715,7 +738,31 @@ struct grid {
 	u_int			 hsize;
 	u_int			 hlimit;
 
+	/* Circular array of lines, line 0 is at lineoff. */
 	struct grid_line	*linedata;
+	u_int			 linesize;
+	u_int			 lineoff;
+
+	/* History lines before hcompressed have been compressed. */
+	u_int			 hcompressed;
+	size_t			 compressed_size;
+
+	/* Storage for line cells. */
+	struct grid_arena	*arena;
+
+	/* File for compressed history, if any. */
+	struct grid_file	*file;
+
+	/* Older history still to be reflowed, if any. */
+	struct grid_reflow	*reflow;
+};
+
+/* Grid cell storage statistics. */
+struct grid_arena_stats {
+	size_t	size;	/* bytes held from the system */
+	size_t	used;	/* bytes asked for by live lines */
+	u_int	live;	/* live cell arrays */
+	u_int	slabs;
 };
 
 /* Hook data structures. */
@@ -815,6 +862,11 @@ struct screen {
 struct screen_write_ctx {
 	struct window_pane *wp;
 	struct screen	*s;
+
+	u_int		*dirty;		/* first and last + 1 cell per line */
+	u_int		 dirtysize;
+	u_int		 dirtyupper;
+	u_int		 dirtylower;
 };
 
 /* Screen size. */
@@ -881,6 +933,7 @@ struct window_pane {
 #define PANE_FOCUSPUSH 0x10
 #define PANE_INPUTOFF 0x20
 #define PANE_CHANGED 0x40
+#define PANE_FRAMED 0x80
 
 	int		 argc;
 	char	       **argv;
@@ -895,6 +948,15 @@ struct window_pane {
 	struct bufferevent *event;
 	struct event	 timer;
 
+	size_t		 read_size;
+	size_t		 read_bytes;
+	size_t		 read_rate;
+	struct timeval	 read_time;
+
+	size_t		 frame_bytes;
+	struct timeval	 frame_time;
+	struct event	 frame_timer;
+
 	struct input_ctx *ictx;
 
 	struct grid_cell colgc;
@@ -905,6 +967,10 @@ struct window_pane {
 
 #ifdef TMATE
 	size_t		 tmate_off;
+	struct evbuffer	*tmate_pty_buffer;
+	struct event	 tmate_pty_timer;
+	int		 tmate_echo;
+	int		 tmate_pty_dropped;
 #endif
 
 	struct screen	*screen;
@@ -925,6 +991,26 @@ struct window_pane {
 TAILQ_HEAD(window_panes, window_pane);
 RB_HEAD(window_pane_tree, window_pane);
 
+/*
+ * Cell of the border map of a window. The map covers the window and the
+ * column and row past it and is rebuilt when the panes change.
+ */
+struct window_cell {
+	struct window_pane *wp;		/* pane whose border or inside this is */
+	struct window_pane *at;		/* pane found by window_get_active_at */
+	u_char		 type;
+};
+
+/* Pane position a border map was built from. */
+struct window_cell_pane {
+	struct window_pane *wp;
+	u_int		 xoff;
+	u_int		 yoff;
+	u_int		 sx;
+	u_int		 sy;
+	int		 visible;
+};
+
 /* Window structure. */
 struct window {
 	u_int		 id;
@@ -966,6 +1052,14 @@ struct window {
 
 	u_int		 references;
 
+	TAILQ_HEAD(, client) viewers;
+
+	struct window_cell *cells;
+	u_int		 cellsx;
+	u_int		 cellsy;
+	struct window_cell_pane *cellpanes;
+	u_int		 ncellpanes;
+
 	RB_ENTRY(window) entry;
 };
 RB_HEAD(windows, window);
@@ -1135,6 +1229,7 @@ struct tty_term {
 	char		 acs[UCHAR_MAX + 1][2];
 
 	struct tty_code	*codes;
+	u_char	       **lengths;
 
 #define TERM_256COLOURS 0x1
 #define TERM_EARLYWRAP 0x2
@@ -1144,6 +1239,18 @@ struct tty_term {
 };
 LIST_HEAD(tty_terms, tty_term);
 
+/* A change of attributes and colours and the sequence which makes it. */
+struct tty_style {
+	u_int64_t	 from;
+	u_int64_t	 to;
+	u_int64_t	 result;
+
+	int		 valid;
+	u_char		 size;
+	char		 data[64];
+};
+#define TTY_STYLES 256
+
 struct tty {
 	struct client	*client;
 	char		*path;
@@ -1171,6 +1278,15 @@ struct tty {
 
 	struct grid_cell cell;
 
+	/* What the terminal is showing, where known. */
+	struct grid_cell *shadow;
+	bitstr_t	*shadow_valid;
+	u_int		 shadow_sx;
+	u_int		 shadow_sy;
+
+	/* Recently used changes of attributes and colours. */
+	struct tty_style *styles;
+
 #define TTY_NOCURSOR 0x1
 #define TTY_FREEZE 0x2
 #define TTY_TIMER 0x4
@@ -1312,6 +1428,9 @@ struct client {
 	struct session	*session;
 	struct session	*last_session;
 
+	struct window	*window;
+	TAILQ_ENTRY(client) wentry;
+
 	int		 wlmouse;
 
 	struct cmd_q	*cmdq;
@@ -1744,6 +1863,10 @@ void	tty_update_mode(struct tty *, int, struct screen *);
 void	tty_force_cursor_colour(struct tty *, const char *);
 void	tty_draw_pane(struct tty *, const struct window_pane *, u_int, u_int,
 	    u_int);
+int	tty_cell_shown(struct tty *, u_int, u_int, const struct grid_cell *,
+	    const struct window_pane *);
+void	tty_invalidate(struct tty *);
+void	tty_clear_styles(struct tty *);
 void	tty_draw_line(struct tty *, const struct window_pane *, struct screen *,
 	    u_int, u_int, u_int);
 int	tty_open(struct tty *, char **);
@@ -1754,6 +1877,7 @@ void	tty_write(void (*)(struct tty *, const struct tty_ctx *),
 int	tty_client_ready(struct client *, struct window_pane *wp);
 void	tty_cmd_alignmenttest(struct tty *, const struct tty_ctx *);
 void	tty_cmd_cell(struct tty *, const struct tty_ctx *);
+void	tty_cmd_cells(struct tty *, const struct tty_ctx *);
 void	tty_cmd_clearendofline(struct tty *, const struct tty_ctx *);
 void	tty_cmd_clearendofscreen(struct tty *, const struct tty_ctx *);
 void	tty_cmd_clearline(struct tty *, const struct tty_ctx *);
@@ -1786,6 +1910,10 @@ const char	*tty_term_ptr1(struct tty_term *, enum tty_code_code,
 		     const void *);
 const char	*tty_term_ptr2(struct tty_term *, enum tty_code_code,
 		     const void *, const void *);
+u_int		 tty_term_length(struct tty_term *, enum tty_code_code);
+u_int		 tty_term_length1(struct tty_term *, enum tty_code_code, u_int);
+u_int		 tty_term_length2(struct tty_term *, enum tty_code_code, u_int,
+		     u_int);
 int		 tty_term_number(struct tty_term *, enum tty_code_code);
 int		 tty_term_flag(struct tty_term *, enum tty_code_code);
 const char	*tty_term_describe(struct tty_term *, enum tty_code_code);
@@ -2027,8 +2155,18 @@ void	 grid_scroll_history_region(struct grid *, u_int, u_int);
 void	 grid_clear_history(struct grid *);
 void	 grid_expand_line(struct grid *, u_int, u_int);
 const struct grid_line *grid_peek_line(struct grid *, u_int);
+const struct grid_cell_entry *grid_peek_cell(const struct grid_line *, u_int,
+	     const struct grid_cell **);
+void	 grid_entry_get_cell(const struct grid_cell_entry *,
+	     struct grid_cell *);
 void	 grid_get_cell(struct grid *, u_int, u_int, struct grid_cell *);
 void	 grid_set_cell(struct grid *, u_int, u_int, const struct grid_cell *);
+struct grid_line *grid_get_line(struct grid *, u_int);
+unsigned long long grid_history_bytes(struct grid *);
+void	 grid_arena_stats(struct grid *, struct grid_arena_stats *);
+void	 grid_adjust_lines(struct grid *, u_int);
+void	 grid_set_cells(struct grid *, u_int, u_int, const struct grid_cell *,
+	     const u_char *, u_int);
 void	 grid_clear(struct grid *, u_int, u_int, u_int, u_int);
 void	 grid_clear_lines(struct grid *, u_int, u_int);
 void	 grid_move_lines(struct grid *, u_int, u_int, u_int);
@@ -2037,12 +2175,16 @@ char	*grid_string_cells(struct grid *, u_int, u_int, u_int,
 	     struct grid_cell **, int, int, int);
 void	 grid_duplicate_lines(struct grid *, u_int, struct grid *, u_int,
 	     u_int);
+void	 grid_swap_lines(struct grid *, u_int, struct grid *, u_int, u_int);
 u_int	 grid_reflow(struct grid *, struct grid *, u_int);
+void	 grid_reflow_finish(struct grid *);
 
 /* grid-view.c */
 void	 grid_view_get_cell(struct grid *, u_int, u_int, struct grid_cell *);
 void	 grid_view_set_cell(struct grid *, u_int, u_int,
 	     const struct grid_cell *);
+void	 grid_view_set_cells(struct grid *, u_int, u_int,
+	     const struct grid_cell *, const u_char *, u_int);
 void	 grid_view_clear_history(struct grid *);
 void	 grid_view_clear(struct grid *, u_int, u_int, u_int, u_int);
 void	 grid_view_scroll_region_up(struct grid *, u_int, u_int);
@@ -2100,12 +2242,15 @@ void	 screen_write_clearstartofscreen(struct screen_write_ctx *);
 void	 screen_write_clearscreen(struct screen_write_ctx *);
 void	 screen_write_clearhistory(struct screen_write_ctx *);
 void	 screen_write_cell(struct screen_write_ctx *, const struct grid_cell *);
+void	 screen_write_run(struct screen_write_ctx *, const struct grid_cell *,
+	     const u_char *, u_int);
 void	 screen_write_setselection(struct screen_write_ctx *, u_char *, u_int);
 void	 screen_write_rawstring(struct screen_write_ctx *, u_char *, u_int);
 
 /* screen-redraw.c */
 void	 screen_redraw_screen(struct client *, int, int, int);
 void	 screen_redraw_pane(struct client *, struct window_pane *);
+void	 screen_redraw_update_cells(struct window *);
 
 /* screen.c */
 void	 screen_init(struct screen *, u_int, u_int, u_int);
@@ -2183,6 +2328,7 @@ int		 window_pane_spawn(struct window_pane *, int, char **,
 		     const char *, const char *, const char *, struct environ *,
 		     struct termios *, char **);
 void		 window_pane_resize(struct window_pane *, u_int, u_int);
+size_t		 window_pane_read_rate(struct window_pane *);
 void		 window_pane_alternate_on(struct window_pane *,
 		     struct grid_cell *, int);
 void		 window_pane_alternate_off(struct window_pane *,
@@ -0,0 +1,217 @@
+#!/usr/bin/env python3
+#
+# Replay recorded terminal output through a tmate server and measure it.
+#
+# Recordings are raw pty output, for example the typescript written by
+# script(1). Each one is written into a pane with cat, so the server parses
+# and draws it as it would the real program.
+#
+# bench.py output [-b tmate] [-t term] [-x cols] [-y rows] recording...
+#	Attach a client to the pane and count the bytes the server writes to
+#	the client's terminal while the recording is replayed. -b may be
+#	given more than once to compare builds.
+#
+# bench.py parse [-b tmate] [-n count] recording...
+#	With no client attached, replay each recording count times and report
+#	how fast the server parses it, in MB of input per second of server CPU
+#	time (from /proc, so Linux only). This covers input_parse and the
+#	screen writes it makes, and also the pane output sent to the tmate
+#	server.
+#
+# The server is started with its own socket and a configuration which points
+# it at a closed local port, so it never connects to a real tmate server.
+
+import argparse
+import fcntl
+import os
+import pty
+import select
+import shlex
+import struct
+import subprocess
+import sys
+import tempfile
+import termios
+import time
+
+QUIET = 0.5		# seconds without output before the client is done
+
+
+class Server:
+	def __init__(self, binary):
+		self.binary = os.path.abspath(binary)
+		self.dir = tempfile.mkdtemp(prefix='tmate-bench.')
+		self.socket = os.path.join(self.dir, 'socket')
+
+		conf = os.path.join(self.dir, 'conf')
+		with open(conf, 'w') as f:
+			f.write('set -g tmate-server-host 127.0.0.1\n')
+			f.write('set -g tmate-server-port 1\n')
+			f.write('set -g status off\n')
+
+		self.proc = subprocess.Popen(
+		    [self.binary, '-F', '-S', self.socket, '-f', conf],
+		    stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL,
+		    stderr=subprocess.DEVNULL)
+		for _ in range(100):
+			if os.path.exists(self.socket):
+				break
+			time.sleep(0.05)
+		else:
+			sys.exit('%s: server did not start' % binary)
+		time.sleep(0.5)
+
+	def command(self, *args, wait=True):
+		argv = [self.binary, '-S', self.socket] + list(args)
+		if not wait:
+			return subprocess.Popen(argv, stdin=subprocess.DEVNULL,
+			    stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+		return subprocess.run(argv, stdin=subprocess.DEVNULL,
+		    stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+		    universal_newlines=True).stdout
+
+	def replay(self, path, count=1):
+		"""Open a window which writes path count times once told to go."""
+		me = '%s -S %s' % (shlex.quote(self.binary), shlex.quote(self.socket))
+		cat = ' '.join([shlex.quote(path)] * count)
+		self.command('new-window', '-d', '-n', 'bench',
+		    '%s wait-for go; cat %s; %s wait-for -S done; exec sleep 3600'
+		    % (me, cat, me))
+		self.command('select-window', '-t', 'bench')
+
+	def cpu(self):
+		"""Return the CPU time used by the server so far, in seconds."""
+		with open('/proc/%d/stat' % self.proc.pid) as f:
+			fields = f.read().rsplit(')', 1)[1].split()
+		return (int(fields[11]) + int(fields[12])) / \
+		    os.sysconf('SC_CLK_TCK')
+
+	def close(self):
+		self.command('kill-server')
+		self.proc.wait()
+		for name in os.listdir(self.dir):
+			os.unlink(os.path.join(self.dir, name))
+		os.rmdir(self.dir)
+
+
+def read_until_quiet(fd, done):
+	"""Read from fd until done() is true and nothing arrives for a while."""
+	total = 0
+	quiet = None
+	while True:
+		ready, _, _ = select.select([fd], [], [], 0.05)
+		if ready:
+			try:
+				data = os.read(fd, 65536)
+			except OSError:
+				break
+			if not data:
+				break
+			total += len(data)
+			quiet = None
+			continue
+		if not done():
+			continue
+		if quiet is None:
+			quiet = time.time()
+		elif time.time() - quiet >= QUIET:
+			break
+	return total
+
+
+def attach(server, term, cols, rows):
+	"""Attach a client in a new pty of the given size."""
+	pid, fd = pty.fork()
+	if pid == 0:
+		os.environ['TERM'] = term
+		os.environ.pop('TMUX', None)
+		os.execv(server.binary,
+		    [server.binary, '-S', server.socket, 'attach'])
+	fcntl.ioctl(fd, termios.TIOCSWINSZ,
+	    struct.pack('HHHH', rows, cols, 0, 0))
+	return pid, fd
+
+
+def bench_output(args):
+	print('%-30s %-20s %12s %8s' % ('recording', 'binary', 'bytes', 'secs'))
+	for path in args.recordings:
+		path = os.path.abspath(path)
+		for binary in args.binary:
+			server = Server(binary)
+			server.replay(path)
+
+			pid, fd = attach(server, args.t, args.x, args.y)
+			read_until_quiet(fd, lambda: True)
+
+			start = time.time()
+			server.command('wait-for', '-S', 'go')
+			done = server.command('wait-for', 'done', wait=False)
+			total = read_until_quiet(fd,
+			    lambda: done.poll() is not None)
+			secs = time.time() - start - QUIET
+
+			server.close()
+			os.close(fd)
+			os.waitpid(pid, 0)
+
+			print('%-30s %-20s %12d %8.2f' % (os.path.basename(path),
+			    binary, total, secs))
+
+
+def bench_parse(args):
+	print('%-30s %-20s %12s %8s %8s' % ('recording', 'binary', 'bytes',
+	    'cpu', 'MB/s'))
+	for path in args.recordings:
+		path = os.path.abspath(path)
+		size = os.path.getsize(path) * args.n
+		for binary in args.binary:
+			server = Server(binary)
+			server.replay(path, args.n)
+
+			start = server.cpu()
+			server.command('wait-for', '-S', 'go')
+			server.command('wait-for', 'done')
+			cpu = server.cpu() - start
+
+			server.close()
+
+			rate = size / cpu / 1e6 if cpu > 0 else float('inf')
+			print('%-30s %-20s %12d %8.2f %8.1f' % (
+			    os.path.basename(path), binary, size, cpu, rate))
+
+
+def main():
+	parser = argparse.ArgumentParser(
+	    description='Replay recorded terminal output through tmate.')
+	sub = parser.add_subparsers(dest='mode')
+
+	p = sub.add_parser('output',
+	    help='count the bytes written to an attached client')
+	p.add_argument('-b', dest='binary', action='append',
+	    help='tmate binary (default ./tmate), may be repeated')
+	p.add_argument('-t', default='screen', help='client TERM')
+	p.add_argument('-x', type=int, default=80, help='client width')
+	p.add_argument('-y', type=int, default=24, help='client height')
+	p.add_argument('recordings', nargs='+')
+	p.set_defaults(func=bench_output)
+
+	p = sub.add_parser('parse',
+	    help='measure parsing speed with no client attached')
+	p.add_argument('-b', dest='binary', action='append',
+	    help='tmate binary (default ./tmate), may be repeated')
+	p.add_argument('-n', type=int, default=1,
+	    help='number of times to replay each recording')
+	p.add_argument('recordings', nargs='+')
+	p.set_defaults(func=bench_parse)
+
+	args = parser.parse_args()
+	if args.mode is None:
+		parser.print_help()
+		sys.exit(1)
+	if not args.binary:
+		args.binary = ['./tmate']
+	args.func(args)
+
+
+if __name__ == '__main__':
+	main()
@@ -35,6 +35,9 @@ char	*tty_term_strip(const char *);
 
 struct tty_terms tty_terms = LIST_HEAD_INITIALIZER(tty_terms);
 
+/* Number of parameter values for which string lengths are cached. */
+#define TTY_TERM_LENGTHS 512
+
 enum tty_code_type {
 	TTYCODE_NONE = 0,
 	TTYCODE_STRING,
@@ -404,6 +407,7 @@ tty_term_find(char *name, int fd, char **cause)
 	term->references = 1;
 	term->flags = 0;
 	term->codes = xcalloc (tty_term_ncodes(), sizeof *term->codes);
+	term->lengths = NULL;
 	LIST_INSERT_HEAD(&tty_terms, term, entry);
 
 	/* Set up curses terminal. */
@@ -547,6 +551,12 @@ tty_term_free(struct tty_term *term)
 	}
 	free(term->codes);
 
+	if (term->lengths != NULL) {
+		for (i = 0; i < tty_term_ncodes(); i++)
+			free(term->lengths[i]);
+		free(term->lengths);
+	}
+
 	free(term->name);
 	free(term);
 }
@@ -592,6 +602,68 @@ tty_term_ptr2(struct tty_term *term, enum tty_code_code code, const void *a,
 	return (tparm((char *) tty_term_string(term, code), a, b, 0, 0, 0, 0, 0, 0, 0));
 }
 
+/*
+ * Length of a string with parameters. Lengths with one parameter zero are
+ * cached per code, the first half of the table for a with b zero and the
+ * second for b with a zero.
+ */
+static u_int
+tty_term_lookup(struct tty_term *term, enum tty_code_code code, u_int a,
+    u_int b)
+{
+	u_char	*lengths;
+	u_int	 idx;
+	size_t	 len;
+
+	if (b == 0 && a < TTY_TERM_LENGTHS)
+		idx = a;
+	else if (a == 0 && b < TTY_TERM_LENGTHS)
+		idx = TTY_TERM_LENGTHS + b;
+	else
+		return (strlen(tty_term_string2(term, code, a, b)));
+
+	if (term->lengths == NULL)
+		term->lengths = xcalloc(tty_term_ncodes(), sizeof *term->lengths);
+	lengths = term->lengths[code];
+	if (lengths == NULL) {
+		lengths = xcalloc(2, TTY_TERM_LENGTHS);
+		term->lengths[code] = lengths;
+	}
+
+	if (lengths[idx] == 0) {
+		len = strlen(tty_term_string2(term, code, a, b));
+		if (len > UCHAR_MAX)
+			return (len);
+		lengths[idx] = len;
+	}
+	return (lengths[idx]);
+}
+
+u_int
+tty_term_length(struct tty_term *term, enum tty_code_code code)
+{
+	return (strlen(tty_term_string(term, code)));
+}
+
+u_int
+tty_term_length1(struct tty_term *term, enum tty_code_code code, u_int a)
+{
+	return (tty_term_lookup(term, code, a, 0));
+}
+
+/*
+ * Length of a string with two parameters. This assumes the parameters are
+ * expanded independently, which is true of every cursor movement string in
+ * practice, so it can be worked out from the cached single lengths.
+ */
+u_int
+tty_term_length2(struct tty_term *term, enum tty_code_code code, u_int a,
+    u_int b)
+{
+	return (tty_term_lookup(term, code, a, 0) +
+	    tty_term_lookup(term, code, 0, b) - tty_term_lookup(term, code, 0, 0));
+}
+
 int
 tty_term_number(struct tty_term *term, enum tty_code_code code)
 {
@@ -33,6 +33,9 @@
 
 static int tty_log_fd = -1;
 
+/* Style change being recorded by tty_puts, if any. */
+static struct tty_style *tty_style_current;
+
 void	tty_read_callback(struct bufferevent *, void *);
 void	tty_error_callback(struct bufferevent *, short, void *);
 
@@ -41,6 +44,26 @@ static int tty_same_bg(const struct grid_cell *, const struct grid_cell *);
 static int tty_same_colours(const struct grid_cell *, const struct grid_cell *);
 static int tty_is_fg(const struct grid_cell *, int);
 static int tty_is_bg(const struct grid_cell *, int);
+static int tty_draw_simple(const struct grid_cell_entry *);
+static void tty_draw_span(struct tty *, const struct window_pane *,
+    struct screen *, u_int, u_int, u_int, u_int, u_int, int);
+
+static int tty_shadow_start(struct tty *);
+static void tty_shadow_free(struct tty *);
+static void tty_shadow_clear(struct tty *, u_int, u_int, u_int, u_int);
+static void tty_shadow_put(struct tty *, u_int, const u_char *, size_t,
+	    u_int);
+static void tty_shadow_code(struct tty *, enum tty_code_code);
+static int tty_shadow_check(struct tty *, u_int, u_int,
+	    const struct grid_cell *);
+
+static u_int64_t tty_style_pack(const struct grid_cell *);
+static void tty_style_unpack(struct grid_cell *, u_int64_t);
+static void tty_style_record(struct tty_style *, const char *);
+static void tty_attributes_target(struct tty *, const struct grid_cell *,
+	    const struct window_pane *, struct grid_cell *);
+static void tty_attributes_check(struct tty *, struct grid_cell *);
+static void tty_attributes_set(struct tty *, struct grid_cell *);
 
 void	tty_set_italics(struct tty *);
 int	tty_try_256(struct tty *, u_char, const char *);
@@ -221,6 +244,7 @@ tty_set_size(struct tty *tty, u_int sx, u_int sy) {
 		return (0);
 	tty->sx = sx;
 	tty->sy = sy;
+	tty_shadow_free(tty);
 	return (1);
 }
 
@@ -295,6 +319,7 @@ tty_start_tty(struct tty *tty)
 
 	tty_putcode(tty, TTYC_SGR0);
 	memcpy(&tty->cell, &grid_default_cell, sizeof tty->cell);
+	tty_clear_styles(tty);
 
 	tty_putcode(tty, TTYC_RMKX);
 	if (tty_use_acs(tty))
@@ -409,6 +434,9 @@ tty_free(struct tty *tty)
 {
 	tty_close(tty);
 
+	tty_shadow_free(tty);
+	free(tty->styles);
+
 	free(tty->ccolour);
 	free(tty->path);
 	free(tty->termname);
@@ -420,6 +448,8 @@ tty_raw(struct tty *tty, const char *s)
 	ssize_t	n, slen;
 	u_int	i;
 
+	tty_invalidate(tty);
+
 	slen = strlen(s);
 	for (i = 0; i < 5; i++) {
 		n = write(tty->fd, s, slen);
@@ -437,6 +467,7 @@ tty_raw(struct tty *tty, const char *s)
 void
 tty_putcode(struct tty *tty, enum tty_code_code code)
 {
+	tty_shadow_code(tty, code);
 	tty_puts(tty, tty_term_string(tty->term, code));
 }
 
@@ -445,6 +476,7 @@ tty_putcode1(struct tty *tty, enum tty_code_code code, int a)
 {
 	if (a < 0)
 		return;
+	tty_shadow_code(tty, code);
 	tty_puts(tty, tty_term_string1(tty->term, code, a));
 }
 
@@ -453,6 +485,7 @@ tty_putcode2(struct tty *tty, enum tty_code_code code, int a, int b)
 {
 	if (a < 0 || b < 0)
 		return;
+	tty_shadow_code(tty, code);
 	tty_puts(tty, tty_term_string2(tty->term, code, a, b));
 }
 
@@ -478,6 +511,9 @@ tty_puts(struct tty *tty, const char *s)
 		return;
 	bufferevent_write(tty->event, s, strlen(s));
 
+	if (tty_style_current != NULL)
+		tty_style_record(tty_style_current, s);
+
 	if (tty_log_fd != -1)
 		write(tty_log_fd, s, strlen(s));
 }
@@ -488,6 +524,11 @@ tty_putc(struct tty *tty, u_char ch)
 	const char	*acs;
 	u_int		 sx;
 
+	if (ch >= 0x20 && ch != 0x7f)
+		tty_shadow_put(tty, 0, &ch, 1, 1);
+	else if (ch == '\n' && tty->cy == tty->rlower)
+		tty_shadow_clear(tty, 0, tty->rupper, UINT_MAX, tty->rlower);
+
 	if (tty->cell.attr & GRID_ATTR_CHARSET) {
 		acs = tty_acs_get(tty, ch);
 		if (acs != NULL)
@@ -517,12 +558,243 @@ tty_putc(struct tty *tty, u_char ch)
 void
 tty_putn(struct tty *tty, const void *buf, size_t len, u_int width)
 {
+	const u_char	*cp = buf;
+	size_t		 i;
+
+	/* Either a run of ASCII characters or one UTF-8 character. */
+	if (*cp < 0x80) {
+		for (i = 0; i < len; i++)
+			tty_shadow_put(tty, i, cp + i, 1, 1);
+	} else
+		tty_shadow_put(tty, 0, cp, len, width);
+
 	bufferevent_write(tty->event, buf, len);
 	if (tty_log_fd != -1)
 		write(tty_log_fd, buf, len);
 	tty->cx += width;
 }
 
+/* Make the shadow ready for use, returning 0 if it can't be used. */
+static int
+tty_shadow_start(struct tty *tty)
+{
+	if (tty->term == NULL || tty->term->flags & TERM_EARLYWRAP)
+		return (0);
+	if (tty->sx == 0 || tty->sy == 0)
+		return (0);
+
+	if (tty->shadow == NULL) {
+		tty->shadow = xreallocarray(NULL, tty->sx * tty->sy,
+		    sizeof *tty->shadow);
+		if ((tty->shadow_valid = bit_alloc(tty->sx * tty->sy)) == NULL)
+			fatal("bit_alloc failed");
+		tty->shadow_sx = tty->sx;
+		tty->shadow_sy = tty->sy;
+	}
+	return (1);
+}
+
+/* Free the shadow. */
+static void
+tty_shadow_free(struct tty *tty)
+{
+	free(tty->shadow);
+	tty->shadow = NULL;
+	free(tty->shadow_valid);
+	tty->shadow_valid = NULL;
+}
+
+/* Forget what is in part of the shadow, from px to the end of line py to ey. */
+static void
+tty_shadow_clear(struct tty *tty, u_int px, u_int py, u_int nx, u_int ey)
+{
+	u_int	sx = tty->shadow_sx, yy;
+
+	if (tty->shadow == NULL)
+		return;
+	if (px >= sx || py == UINT_MAX) {
+		if (px == UINT_MAX || py == UINT_MAX) {
+			tty_invalidate(tty);
+			return;
+		}
+		px = sx - 1;
+	}
+	if (nx > sx - px)
+		nx = sx - px;
+	if (ey >= tty->shadow_sy)
+		ey = tty->shadow_sy - 1;
+
+	for (yy = py; yy <= ey; yy++)
+		bit_nclear(tty->shadow_valid, yy * sx + px, yy * sx + px + nx - 1);
+}
+
+/* Forget everything in the shadow. */
+void
+tty_invalidate(struct tty *tty)
+{
+	if (tty->shadow != NULL) {
+		bit_nclear(tty->shadow_valid, 0,
+		    tty->shadow_sx * tty->shadow_sy - 1);
+	}
+}
+
+/*
+ * Record a character written to the terminal off cells after the cursor,
+ * with the current attributes.
+ */
+static void
+tty_shadow_put(struct tty *tty, u_int off, const u_char *data, size_t size,
+    u_int width)
+{
+	struct grid_cell	*sc;
+	u_int			 sx = tty->shadow_sx, x = tty->cx, y = tty->cy;
+	u_int			 i;
+
+	if (tty->shadow == NULL)
+		return;
+	if (x == UINT_MAX || y >= tty->shadow_sy) {
+		tty_invalidate(tty);
+		return;
+	}
+
+	/* At the very end of the line, the terminal wraps first. */
+	if (x >= sx) {
+		if (y == tty->rlower)
+			tty_shadow_clear(tty, 0, tty->rupper, UINT_MAX, y);
+		else
+			y++;
+		x = 0;
+	}
+	x += off;
+	if (x + width > sx || y >= tty->shadow_sy) {
+		tty_invalidate(tty);
+		return;
+	}
+
+	/* Overwriting half of a wide character loses all of it. */
+	if (x != 0 && bit_test(tty->shadow_valid, y * sx + x - 1) &&
+	    tty->shadow[y * sx + x - 1].data.width > 1)
+		bit_clear(tty->shadow_valid, y * sx + x - 1);
+
+	sc = &tty->shadow[y * sx + x];
+	memcpy(sc, &tty->cell, sizeof *sc);
+	memcpy(sc->data.data, data, size);
+	sc->data.size = size;
+	sc->data.width = width;
+	bit_set(tty->shadow_valid, y * sx + x);
+	for (i = 1; i < width; i++)
+		bit_clear(tty->shadow_valid, y * sx + x + i);
+}
+
+/* Update the shadow for a terminal code which may change what is shown. */
+static void
+tty_shadow_code(struct tty *tty, enum tty_code_code code)
+{
+	if (tty->shadow == NULL)
+		return;
+
+	switch (code) {
+	case TTYC_BEL:
+	case TTYC_BLINK:
+	case TTYC_BOLD:
+	case TTYC_CIVIS:
+	case TTYC_CNORM:
+	case TTYC_CR:
+	case TTYC_CSR:
+	case TTYC_CUB:
+	case TTYC_CUB1:
+	case TTYC_CUD:
+	case TTYC_CUD1:
+	case TTYC_CUF:
+	case TTYC_CUF1:
+	case TTYC_CUP:
+	case TTYC_CUU:
+	case TTYC_CUU1:
+	case TTYC_CVVIS:
+	case TTYC_DIM:
+	case TTYC_ENACS:
+	case TTYC_FSL:
+	case TTYC_HOME:
+	case TTYC_HPA:
+	case TTYC_INVIS:
+	case TTYC_REV:
+	case TTYC_RMACS:
+	case TTYC_RMKX:
+	case TTYC_SE:
+	case TTYC_SETAB:
+	case TTYC_SETAF:
+	case TTYC_SGR0:
+	case TTYC_SITM:
+	case TTYC_SMACS:
+	case TTYC_SMKX:
+	case TTYC_SMSO:
+	case TTYC_SMUL:
+	case TTYC_SS:
+	case TTYC_TSL:
+	case TTYC_VPA:
+		break;
+	case TTYC_EL:
+	case TTYC_ECH:
+	case TTYC_ICH:
+	case TTYC_ICH1:
+	case TTYC_DCH:
+	case TTYC_DCH1:
+		tty_shadow_clear(tty, tty->cx, tty->cy, UINT_MAX, tty->cy);
+		break;
+	case TTYC_EL1:
+		tty_shadow_clear(tty, 0, tty->cy, UINT_MAX, tty->cy);
+		break;
+	case TTYC_IL:
+	case TTYC_IL1:
+	case TTYC_DL:
+	case TTYC_DL1:
+		tty_shadow_clear(tty, 0, tty->cy, UINT_MAX, tty->rlower);
+		break;
+	case TTYC_RI:
+		tty_shadow_clear(tty, 0, tty->rupper, UINT_MAX, tty->rlower);
+		break;
+	default:
+		tty_invalidate(tty);
+		break;
+	}
+}
+
+/* Check if the terminal already shows a cell, given its final attributes. */
+static int
+tty_shadow_check(struct tty *tty, u_int px, u_int py,
+    const struct grid_cell *gc)
+{
+	struct grid_cell	*sc;
+	u_int			 idx;
+
+	if (tty->shadow == NULL || px >= tty->shadow_sx ||
+	    py >= tty->shadow_sy)
+		return (0);
+	idx = py * tty->shadow_sx + px;
+	if (!bit_test(tty->shadow_valid, idx))
+		return (0);
+	sc = &tty->shadow[idx];
+
+	if (sc->attr != gc->attr || !tty_same_colours(sc, gc))
+		return (0);
+	if (sc->data.size != gc->data.size || sc->data.width != gc->data.width)
+		return (0);
+	return (memcmp(sc->data.data, gc->data.data, gc->data.size) == 0);
+}
+
+/* Check if the terminal already shows a cell at a position. */
+int
+tty_cell_shown(struct tty *tty, u_int px, u_int py, const struct grid_cell *gc,
+    const struct window_pane *wp)
+{
+	struct grid_cell	gc2;
+
+	if (!tty_shadow_start(tty))
+		return (0);
+	tty_attributes_target(tty, gc, wp, &gc2);
+	return (tty_shadow_check(tty, px, py, &gc2));
+}
+
 void
 tty_set_italics(struct tty *tty)
 {
@@ -718,60 +990,197 @@ tty_draw_pane(struct tty *tty, const struct window_pane *wp, u_int py, u_int ox,
 	tty_draw_line(tty, wp, wp->screen, py, ox, oy);
 }
 
+/* Is this cell one which tty_draw_span can write as part of a run? */
+static int
+tty_draw_simple(const struct grid_cell_entry *gce)
+{
+	if (gce->flags & GRID_FLAG_PADDING)
+		return (0);
+	return (gce->data.data >= 0x20 && gce->data.data < 0x7f);
+}
+
 void
 tty_draw_line(struct tty *tty, const struct window_pane *wp,
     struct screen *s, u_int py, u_int ox, u_int oy)
 {
-	struct grid_cell	 gc;
 	struct grid_line	*gl;
-	u_int			 i, sx;
-	int			 flags;
+	int			 move;
+
+	/*
+	 * Don't move the cursor to the start position if it will wrap there
+	 * itself.
+	 */
+	gl = NULL;
+	if (py != 0)
+		gl = grid_get_line(s->grid, s->grid->hsize + py - 1);
+	move = (oy + py == 0 || gl == NULL || !(gl->flags & GRID_LINE_WRAPPED) ||
+	    tty->cx < tty->sx || ox != 0 ||
+	    (oy + py != tty->cy + 1 && tty->cy != s->rlower + oy));
+
+	tty_draw_span(tty, wp, s, py, 0, screen_size_x(s), ox, oy, move);
+}
+
+/*
+ * Draw nx cells of a line starting at px. The rest of the line is cleared
+ * only if the span reaches the end of the line.
+ */
+static void
+tty_draw_span(struct tty *tty, const struct window_pane *wp,
+    struct screen *s, u_int py, u_int px, u_int nx, u_int ox, u_int oy,
+    int move)
+{
+	struct grid_cell		 gc, gc2;
+	struct grid_line		*gl;
+	const struct grid_line		*cgl;
+	const struct grid_cell		*gcp;
+	const struct grid_cell_entry	*gce, *gce2;
+	u_char				 buf[256];
+	u_int				 i, j, n, sx, ex;
+	int				 flags, shadow, placed, el, tail;
 
 	flags = tty->flags & TTY_NOCURSOR;
 	tty->flags |= TTY_NOCURSOR;
 	tty_update_mode(tty, tty->mode, s);
 
-	sx = screen_size_x(s);
-	if (sx > s->grid->linedata[s->grid->hsize + py].cellsize)
-		sx = s->grid->linedata[s->grid->hsize + py].cellsize;
+	sx = px + nx;
+	tail = (sx >= screen_size_x(s));
+	gl = grid_get_line(s->grid, s->grid->hsize + py);
+	if (sx > gl->cellsize)
+		sx = gl->cellsize;
 	if (sx > tty->sx)
 		sx = tty->sx;
 
 	/*
-	 * Don't move the cursor to the start position if it will wrap there
-	 * itself.
+	 * Cells the terminal already shows are skipped, so the cursor is only
+	 * moved before the first cell that is written after a gap.
 	 */
-	gl = NULL;
-	if (py != 0)
-		gl = &s->grid->linedata[s->grid->hsize + py - 1];
-	if (oy + py == 0 || gl == NULL || !(gl->flags & GRID_LINE_WRAPPED) ||
-	    tty->cx < tty->sx || ox != 0 ||
-	    (oy + py != tty->cy + 1 && tty->cy != s->rlower + oy))
-		tty_cursor(tty, ox, oy + py);
+	shadow = tty_shadow_start(tty);
+	placed = 0;
+
+	/* Start at the beginning of any wide character px is part of. */
+	while (px > 0 && px < sx) {
+		grid_get_cell(s->grid, px, s->grid->hsize + py, &gc);
+		if (~gc.flags & GRID_FLAG_PADDING)
+			break;
+		px--;
+	}
+
+	cgl = grid_peek_line(s->grid, s->grid->hsize + py);
+	for (i = px; i < sx; i++) {
+		gce = grid_peek_cell(cgl, i, &gcp);
+		if (gcp == NULL && !s->sel.flag && tty_draw_simple(gce)) {
+			grid_entry_get_cell(gce, &gc);
+			if (shadow) {
+				tty_attributes_target(tty, &gc, wp, &gc2);
+				if (tty_shadow_check(tty, ox + i, oy + py, &gc2)) {
+					placed = 0;
+					continue;
+				}
+			}
+
+			/*
+			 * Collect a run of printable ASCII cells with the same
+			 * attributes and write them together.
+			 */
+			n = 0;
+			for (j = i; j < sx && n < sizeof buf; j++) {
+				gce2 = grid_peek_cell(cgl, j, &gcp);
+				if (gcp != NULL || !tty_draw_simple(gce2))
+					break;
+				if (gce2->flags != gce->flags ||
+				    gce2->data.attr != gce->data.attr ||
+				    gce2->data.fg != gce->data.fg ||
+				    gce2->data.bg != gce->data.bg)
+					break;
+				if (shadow && j != i) {
+					utf8_set(&gc2.data, gce2->data.data);
+					if (tty_shadow_check(tty, ox + j, oy + py,
+					    &gc2))
+						break;
+				}
+				buf[n++] = gce2->data.data;
+			}
+
+			if (!placed && (i != 0 || move))
+				tty_cursor(tty, ox + i, oy + py);
+			placed = 1;
+
+			if (~tty->term->flags & TERM_EARLYWRAP &&
+			    tty->cx + n <= tty->sx) {
+				tty_attributes(tty, &gc, wp);
+				if (~tty->cell.attr & GRID_ATTR_CHARSET) {
+					tty_putn(tty, buf, n, n);
+					i += n - 1;
+					continue;
+				}
+			}
+			for (j = 0; j < n; j++) {
+				utf8_set(&gc.data, buf[j]);
+				tty_cell(tty, &gc, wp);
+			}
+			i += n - 1;
+			continue;
+		}
 
-	for (i = 0; i < sx; i++) {
-		grid_view_get_cell(s->grid, i, py, &gc);
+		if (gcp != NULL)
+			memcpy(&gc, gcp, sizeof gc);
+		else
+			grid_entry_get_cell(gce, &gc);
 		if (screen_check_selection(s, i, py)) {
 			gc.flags &= ~(GRID_FLAG_FG256|GRID_FLAG_BG256);
 			gc.flags |= s->sel.cell.flags &
 			    (GRID_FLAG_FG256|GRID_FLAG_BG256);
 		}
+		if (gc.flags & GRID_FLAG_PADDING)
+			continue;
+		if (shadow) {
+			tty_attributes_target(tty, &gc, wp, &gc2);
+			if (tty_shadow_check(tty, ox + i, oy + py, &gc2)) {
+				placed = 0;
+				continue;
+			}
+		}
+
+		if (!placed && (i != 0 || move))
+			tty_cursor(tty, ox + i, oy + py);
+		placed = 1;
 		tty_cell(tty, &gc, wp);
 	}
 
-	if (sx < tty->sx) {
+	if (tail && sx < tty->sx) {
+		el = (sx != screen_size_x(s) &&
+		    ox + screen_size_x(s) >= tty->sx &&
+		    tty_term_has(tty->term, TTYC_EL) &&
+		    !tty_fake_bce(tty, wp));
+
+		/* Nothing to do if the rest of the line is already clear. */
+		if (shadow) {
+			ex = ox + screen_size_x(s);
+			if (el || ex > tty->sx)
+				ex = tty->sx;
+			tty_attributes_target(tty, &grid_default_cell, wp, &gc2);
+			for (i = ox + sx; i < ex; i++) {
+				if (!tty_shadow_check(tty, i, oy + py, &gc2))
+					break;
+			}
+			if (i == ex)
+				goto out;
+		}
+
 		tty_attributes(tty, &grid_default_cell, wp);
 
 		tty_cursor(tty, ox + sx, oy + py);
-		if (sx != screen_size_x(s) &&
-		    ox + screen_size_x(s) >= tty->sx &&
-		    tty_term_has(tty->term, TTYC_EL) &&
-		    !tty_fake_bce(tty, wp))
+		if (el) {
 			tty_putcode(tty, TTYC_EL);
-		else
+			if (tty->cell.attr == 0) {
+				for (i = 0; tty->cx + i < tty->sx; i++)
+					tty_shadow_put(tty, i, (const u_char *)" ", 1, 1);
+			}
+		} else
 			tty_repeat_space(tty, screen_size_x(s) - sx);
 	}
 
+out:
 	tty->flags = (tty->flags & ~TTY_NOCURSOR) | flags;
 	tty_update_mode(tty, tty->mode, s);
 }
@@ -806,7 +1215,11 @@ tty_write(void (*cmdfn)(struct tty *, const struct tty_ctx *),
 	if (!window_pane_visible(wp) || wp->flags & PANE_DROP)
 		return;
 
-	TAILQ_FOREACH(c, &clients, entry) {
+	/* Flooding panes are redrawn by a timer instead. */
+	if (wp->flags & PANE_FRAMED)
+		return;
+
+	TAILQ_FOREACH(c, &wp->window->viewers, wentry) {
 		if (!tty_client_ready(c, wp))
 			continue;
 
@@ -1164,6 +1577,16 @@ tty_cmd_cell(struct tty *tty, const struct tty_ctx *ctx)
 	tty_cell(tty, ctx->cell, wp);
 }
 
+void
+tty_cmd_cells(struct tty *tty, const struct tty_ctx *ctx)
+{
+	struct window_pane	*wp = ctx->wp;
+
+	tty_region_pane(tty, ctx, ctx->orupper, ctx->orlower);
+	tty_draw_span(tty, wp, wp->screen, ctx->ocy, ctx->ocx, ctx->num,
+	    ctx->xoff, ctx->yoff, 1);
+}
+
 void
 tty_cmd_utf8character(struct tty *tty, const struct tty_ctx *ctx)
 {
@@ -1203,6 +1626,8 @@ tty_cmd_rawstring(struct tty *tty, const struct tty_ctx *ctx)
 	for (i = 0; i < ctx->num; i++)
 		tty_putc(tty, str[i]);
 
+	/* The terminal doesn't show the string, and it may change anything. */
+	tty_invalidate(tty);
 	tty->cx = tty->cy = UINT_MAX;
 	tty->rupper = tty->rlower = UINT_MAX;
 
@@ -1290,7 +1715,9 @@ tty_region(struct tty *tty, u_int rupper, u_int rlower)
 	if (tty->cx >= tty->sx)
 		tty_cursor(tty, 0, tty->cy);
 
+	/* The terminal moves the cursor home, so where it was is not known. */
 	tty_putcode2(tty, TTYC_CSR, tty->rupper, tty->rlower);
+	tty->cx = tty->cy = UINT_MAX;
 	tty_cursor(tty, 0, 0);
 }
 
@@ -1301,13 +1728,234 @@ tty_cursor_pane(struct tty *tty, const struct tty_ctx *ctx, u_int cx, u_int cy)
 	tty_cursor(tty, ctx->xoff + cx, ctx->yoff + cy);
 }
 
-/* Move cursor to absolute position. */
+/* Ways of moving the cursor along one axis. */
+enum tty_cursor_how {
+	TTY_CURSOR_NONE,
+	TTY_CURSOR_CR,
+	TTY_CURSOR_REPEAT,
+	TTY_CURSOR_RELATIVE,
+	TTY_CURSOR_ABSOLUTE,
+	TTY_CURSOR_REWRITE
+};
+
+/*
+ * Check if the cells on a line between two columns are known and can be
+ * written again with the current attributes to move the cursor right.
+ */
+static int
+tty_cursor_rewrite(struct tty *tty, u_int py, u_int from, u_int to)
+{
+	struct grid_cell	*sc;
+	u_int			 px;
+
+	if (tty->shadow == NULL || to > tty->shadow_sx || py >= tty->shadow_sy)
+		return (0);
+	if (tty->cell.attr & GRID_ATTR_CHARSET)
+		return (0);
+
+	for (px = from; px < to; px++) {
+		if (!bit_test(tty->shadow_valid, py * tty->shadow_sx + px))
+			return (0);
+		sc = &tty->shadow[py * tty->shadow_sx + px];
+		if (sc->data.size != 1 || sc->data.width != 1)
+			return (0);
+		if (sc->data.data[0] < 0x20 || sc->data.data[0] > 0x7e)
+			return (0);
+		if (sc->attr != tty->cell.attr || !tty_same_colours(sc, &tty->cell))
+			return (0);
+	}
+	return (1);
+}
+
+/* Check if moving the cursor one line also scrolls at the region edge. */
+static int
+tty_cursor_scrolls(struct tty *tty, int up)
+{
+	struct tty_term	*term = tty->term;
+	const char	*s;
+
+	if (up) {
+		s = tty_term_string(term, TTYC_CUU1);
+		return (tty_term_has(term, TTYC_RI) &&
+		    strcmp(s, tty_term_string(term, TTYC_RI)) == 0);
+	}
+	s = tty_term_string(term, TTYC_CUD1);
+	return (strcmp(s, "\n") == 0);
+}
+
+/* Work out the cheapest way to move the cursor between two rows. */
+static u_int
+tty_cursor_vcost(struct tty *tty, u_int from, u_int to,
+    enum tty_cursor_how *how)
+{
+	struct tty_term	*term = tty->term;
+	u_int		 n, cost, best = UINT_MAX;
+	int		 up = (to < from), relative, repeat;
+
+	*how = TTY_CURSOR_NONE;
+	if (from == to)
+		return (0);
+	n = up ? from - to : to - from;
+
+	/* Relative movement stops at the scroll region. */
+	if (up)
+		relative = !(from >= tty->rupper && to < tty->rupper);
+	else
+		relative = !(from <= tty->rlower && to > tty->rlower);
+
+	/*
+	 * Some terminals use reverse index for cuu1 or line feed for cud1,
+	 * which scroll at the edge of the region instead of stopping, so they
+	 * can't be used when the region isn't known.
+	 */
+	repeat = relative;
+	if (repeat && (up ? tty->rupper : tty->rlower) == UINT_MAX)
+		repeat = !tty_cursor_scrolls(tty, up);
+
+	if (repeat && tty_term_has(term, up ? TTYC_CUU1 : TTYC_CUD1)) {
+		cost = n * tty_term_length(term, up ? TTYC_CUU1 : TTYC_CUD1);
+		if (cost < best) {
+			best = cost;
+			*how = TTY_CURSOR_REPEAT;
+		}
+	}
+	if (relative && tty_term_has(term, up ? TTYC_CUU : TTYC_CUD)) {
+		cost = tty_term_length1(term, up ? TTYC_CUU : TTYC_CUD, n);
+		if (cost < best) {
+			best = cost;
+			*how = TTY_CURSOR_RELATIVE;
+		}
+	}
+	if (tty_term_has(term, TTYC_VPA)) {
+		cost = tty_term_length1(term, TTYC_VPA, to);
+		if (cost < best) {
+			best = cost;
+			*how = TTY_CURSOR_ABSOLUTE;
+		}
+	}
+	return (best);
+}
+
+/* Work out the cheapest way to move the cursor between two columns. */
+static u_int
+tty_cursor_hcost(struct tty *tty, u_int py, u_int from, u_int to,
+    enum tty_cursor_how *how)
+{
+	struct tty_term	*term = tty->term;
+	u_int		 n, cost, best = UINT_MAX;
+	int		 left = (to < from);
+
+	*how = TTY_CURSOR_NONE;
+	if (from == to)
+		return (0);
+	n = left ? from - to : to - from;
+
+	if (to == 0) {
+		best = 1;
+		*how = TTY_CURSOR_CR;
+	}
+	if (tty_term_has(term, left ? TTYC_CUB1 : TTYC_CUF1)) {
+		cost = n * tty_term_length(term, left ? TTYC_CUB1 : TTYC_CUF1);
+		if (cost < best) {
+			best = cost;
+			*how = TTY_CURSOR_REPEAT;
+		}
+	}
+	if (tty_term_has(term, left ? TTYC_CUB : TTYC_CUF)) {
+		cost = tty_term_length1(term, left ? TTYC_CUB : TTYC_CUF, n);
+		if (cost < best) {
+			best = cost;
+			*how = TTY_CURSOR_RELATIVE;
+		}
+	}
+	if (tty_term_has(term, TTYC_HPA)) {
+		cost = tty_term_length1(term, TTYC_HPA, to);
+		if (cost < best) {
+			best = cost;
+			*how = TTY_CURSOR_ABSOLUTE;
+		}
+	}
+	if (!left && n < best && tty_cursor_rewrite(tty, py, from, to)) {
+		best = n;
+		*how = TTY_CURSOR_REWRITE;
+	}
+	return (best);
+}
+
+/* Move the cursor between two rows. */
+static void
+tty_cursor_vmove(struct tty *tty, u_int from, u_int to,
+    enum tty_cursor_how how)
+{
+	u_int	n;
+	int	up = (to < from);
+
+	n = up ? from - to : to - from;
+	switch (how) {
+	case TTY_CURSOR_REPEAT:
+		while (n-- != 0)
+			tty_putcode(tty, up ? TTYC_CUU1 : TTYC_CUD1);
+		break;
+	case TTY_CURSOR_RELATIVE:
+		tty_putcode1(tty, up ? TTYC_CUU : TTYC_CUD, n);
+		break;
+	case TTY_CURSOR_ABSOLUTE:
+		tty_putcode1(tty, TTYC_VPA, to);
+		break;
+	default:
+		break;
+	}
+	tty->cy = to;
+}
+
+/* Move the cursor between two columns. */
+static void
+tty_cursor_hmove(struct tty *tty, u_int py, u_int from, u_int to,
+    enum tty_cursor_how how)
+{
+	u_int	n, px;
+	int	left = (to < from);
+
+	n = left ? from - to : to - from;
+	switch (how) {
+	case TTY_CURSOR_CR:
+		tty_putc(tty, '\r');
+		break;
+	case TTY_CURSOR_REPEAT:
+		while (n-- != 0)
+			tty_putcode(tty, left ? TTYC_CUB1 : TTYC_CUF1);
+		break;
+	case TTY_CURSOR_RELATIVE:
+		tty_putcode1(tty, left ? TTYC_CUB : TTYC_CUF, n);
+		break;
+	case TTY_CURSOR_ABSOLUTE:
+		tty_putcode1(tty, TTYC_HPA, to);
+		break;
+	case TTY_CURSOR_REWRITE:
+		tty->cx = from;
+		tty->cy = py;
+		for (px = from; px < to; px++)
+			tty_putc(tty, tty->shadow[py * tty->shadow_sx + px].data.data[0]);
+		break;
+	default:
+		break;
+	}
+	tty->cx = to;
+}
+
+/*
+ * Move cursor to absolute position. Each way of getting there is costed in
+ * bytes from the terminal's own strings and the shortest is used: absolute
+ * movement, home, moving the row then the column, or a carriage return
+ * first and then the same.
+ */
 void
 tty_cursor(struct tty *tty, u_int cx, u_int cy)
 {
-	struct tty_term	*term = tty->term;
-	u_int		 thisx, thisy;
-	int		 change;
+	struct tty_term		*term = tty->term;
+	enum tty_cursor_how	 vhow, hhow, crhow;
+	u_int			 thisx, thisy, best, v, h, cr;
+	enum { ABSOLUTE, HOME, MOVE, CRMOVE } plan;
 
 	if (cx > tty->sx - 1)
 		cx = tty->sx - 1;
@@ -1319,157 +1967,247 @@ tty_cursor(struct tty *tty, u_int cx, u_int cy)
 	if (cx == thisx && cy == thisy)
 		return;
 
-	/* Very end of the line, just use absolute movement. */
-	if (thisx > tty->sx - 1)
-		goto absolute;
+	/* Very end of the line or unknown, just use absolute movement. */
+	if (thisx > tty->sx - 1) {
+		if (cx == 0 && cy == 0 && tty_term_has(term, TTYC_HOME))
+			tty_putcode(tty, TTYC_HOME);
+		else
+			tty_putcode2(tty, TTYC_CUP, cy, cx);
+		goto out;
+	}
+
+	plan = ABSOLUTE;
+	best = tty_term_length2(term, TTYC_CUP, cy, cx);
 
-	/* Move to home position (0, 0). */
 	if (cx == 0 && cy == 0 && tty_term_has(term, TTYC_HOME)) {
-		tty_putcode(tty, TTYC_HOME);
-		goto out;
+		v = tty_term_length(term, TTYC_HOME);
+		if (v < best) {
+			best = v;
+			plan = HOME;
+		}
+	}
+
+	v = tty_cursor_vcost(tty, thisy, cy, &vhow);
+	if (v < best) {
+		h = tty_cursor_hcost(tty, cy, thisx, cx, &hhow);
+		if (h < best - v) {
+			best = v + h;
+			plan = MOVE;
+		}
+		if (cx != 0 && thisx != 0 && v + 1 < best) {
+			cr = tty_cursor_hcost(tty, cy, 0, cx, &crhow);
+			if (cr < best - v - 1) {
+				best = v + 1 + cr;
+				plan = CRMOVE;
+			}
+		}
 	}
 
-	/* Zero on the next line. */
-	if (cx == 0 && cy == thisy + 1 && thisy != tty->rlower) {
+	switch (plan) {
+	case ABSOLUTE:
+		tty_putcode2(tty, TTYC_CUP, cy, cx);
+		break;
+	case HOME:
+		tty_putcode(tty, TTYC_HOME);
+		break;
+	case MOVE:
+		tty_cursor_vmove(tty, thisy, cy, vhow);
+		tty_cursor_hmove(tty, cy, thisx, cx, hhow);
+		break;
+	case CRMOVE:
 		tty_putc(tty, '\r');
-		tty_putc(tty, '\n');
-		goto out;
+		tty_cursor_vmove(tty, thisy, cy, vhow);
+		tty_cursor_hmove(tty, cy, 0, cx, crhow);
+		break;
 	}
 
-	/* Moving column or row. */
-	if (cy == thisy) {
-		/*
-		 * Moving column only, row staying the same.
-		 */
+out:
+	tty->cx = cx;
+	tty->cy = cy;
+}
 
-		/* To left edge. */
-		if (cx == 0)	{
-			tty_putc(tty, '\r');
-			goto out;
-		}
+/* Work out the attributes and colours the terminal will use for a cell. */
+static void
+tty_attributes_target(struct tty *tty, const struct grid_cell *gc,
+    const struct window_pane *wp, struct grid_cell *gc2)
+{
+	memcpy(gc2, gc, sizeof *gc2);
+	tty_default_colours(gc2, wp);
+	tty_attributes_check(tty, gc2);
+}
 
-		/* One to the left. */
-		if (cx == thisx - 1 && tty_term_has(term, TTYC_CUB1)) {
-			tty_putcode(tty, TTYC_CUB1);
-			goto out;
+/* Fix up attributes and colours for what the terminal supports. */
+static void
+tty_attributes_check(struct tty *tty, struct grid_cell *gc2)
+{
+	/*
+	 * If no setab, try to use the reverse attribute as a best-effort for a
+	 * non-default background. This is a bit of a hack but it doesn't do
+	 * any serious harm and makes a couple of applications happier.
+	 */
+	if (!tty_term_has(tty->term, TTYC_SETAB)) {
+		if (gc2->attr & GRID_ATTR_REVERSE) {
+			if (gc2->fg != 7 && gc2->fg != 8)
+				gc2->attr &= ~GRID_ATTR_REVERSE;
+		} else {
+			if (gc2->bg != 0 && gc2->bg != 8)
+				gc2->attr |= GRID_ATTR_REVERSE;
 		}
+	}
 
-		/* One to the right. */
-		if (cx == thisx + 1 && tty_term_has(term, TTYC_CUF1)) {
-			tty_putcode(tty, TTYC_CUF1);
-			goto out;
-		}
+	/* Fix up the colours if necessary. */
+	tty_check_fg(tty, gc2);
+	tty_check_bg(tty, gc2);
+}
 
-		/* Calculate difference. */
-		change = thisx - cx;	/* +ve left, -ve right */
+/* Pack the attributes and colours of a cell into a single value. */
+static u_int64_t
+tty_style_pack(const struct grid_cell *gc)
+{
+	u_int64_t	v;
 
-		/*
-		 * Use HPA if change is larger than absolute, otherwise move
-		 * the cursor with CUB/CUF.
-		 */
-		if ((u_int) abs(change) > cx && tty_term_has(term, TTYC_HPA)) {
-			tty_putcode1(tty, TTYC_HPA, cx);
-			goto out;
-		} else if (change > 0 && tty_term_has(term, TTYC_CUB)) {
-			tty_putcode1(tty, TTYC_CUB, change);
-			goto out;
-		} else if (change < 0 && tty_term_has(term, TTYC_CUF)) {
-			tty_putcode1(tty, TTYC_CUF, -change);
-			goto out;
-		}
-	} else if (cx == thisx) {
-		/*
-		 * Moving row only, column staying the same.
-		 */
+	v = gc->flags & (GRID_FLAG_FG256|GRID_FLAG_BG256|GRID_FLAG_FGRGB|
+	    GRID_FLAG_BGRGB);
+	v = (v << 8) | gc->attr;
 
-		/* One above. */
-		if (thisy != tty->rupper &&
-		    cy == thisy - 1 && tty_term_has(term, TTYC_CUU1)) {
-			tty_putcode(tty, TTYC_CUU1);
-			goto out;
-		}
+	v <<= 24;
+	if (gc->flags & GRID_FLAG_FGRGB) {
+		v |= ((u_int64_t)gc->fg_rgb.r << 16) | (gc->fg_rgb.g << 8) |
+		    gc->fg_rgb.b;
+	} else
+		v |= gc->fg;
 
-		/* One below. */
-		if (thisy != tty->rlower &&
-		    cy == thisy + 1 && tty_term_has(term, TTYC_CUD1)) {
-			tty_putcode(tty, TTYC_CUD1);
-			goto out;
-		}
+	v <<= 24;
+	if (gc->flags & GRID_FLAG_BGRGB) {
+		v |= ((u_int64_t)gc->bg_rgb.r << 16) | (gc->bg_rgb.g << 8) |
+		    gc->bg_rgb.b;
+	} else
+		v |= gc->bg;
 
-		/* Calculate difference. */
-		change = thisy - cy;	/* +ve up, -ve down */
+	return (v);
+}
 
-		/*
-		 * Try to use VPA if change is larger than absolute or if this
-		 * change would cross the scroll region, otherwise use CUU/CUD.
-		 */
-		if ((u_int) abs(change) > cy ||
-		    (change < 0 && cy - change > tty->rlower) ||
-		    (change > 0 && cy - change < tty->rupper)) {
-			    if (tty_term_has(term, TTYC_VPA)) {
-				    tty_putcode1(tty, TTYC_VPA, cy);
-				    goto out;
-			    }
-		} else if (change > 0 && tty_term_has(term, TTYC_CUU)) {
-			tty_putcode1(tty, TTYC_CUU, change);
-			goto out;
-		} else if (change < 0 && tty_term_has(term, TTYC_CUD)) {
-			tty_putcode1(tty, TTYC_CUD, -change);
-			goto out;
-		}
+/* Set the attributes and colours of a cell from a packed value. */
+static void
+tty_style_unpack(struct grid_cell *gc, u_int64_t v)
+{
+	gc->bg_rgb.r = (v >> 16) & 0xff;
+	gc->bg_rgb.g = (v >> 8) & 0xff;
+	gc->bg_rgb.b = v & 0xff;
+	v >>= 24;
+
+	gc->fg_rgb.r = (v >> 16) & 0xff;
+	gc->fg_rgb.g = (v >> 8) & 0xff;
+	gc->fg_rgb.b = v & 0xff;
+	v >>= 24;
+
+	gc->attr = v & 0xff;
+	gc->flags = v >> 8;
+
+	if (~gc->flags & GRID_FLAG_FGRGB) {
+		gc->fg = gc->fg_rgb.b;
+		gc->fg_rgb.g = gc->fg_rgb.b = 0;
+	}
+	if (~gc->flags & GRID_FLAG_BGRGB) {
+		gc->bg = gc->bg_rgb.b;
+		gc->bg_rgb.g = gc->bg_rgb.b = 0;
 	}
+}
 
-absolute:
-	/* Absolute movement. */
-	tty_putcode2(tty, TTYC_CUP, cy, cx);
+/* Add to the sequence for a style change, giving up if it is too long. */
+static void
+tty_style_record(struct tty_style *ts, const char *s)
+{
+	size_t	len = strlen(s);
 
-out:
-	tty->cx = cx;
-	tty->cy = cy;
+	if (len >= sizeof ts->data - ts->size) {
+		ts->size = sizeof ts->data;
+		return;
+	}
+	memcpy(ts->data + ts->size, s, len + 1);
+	ts->size += len;
 }
 
+/* Forget all style changes. */
+void
+tty_clear_styles(struct tty *tty)
+{
+	free(tty->styles);
+	tty->styles = NULL;
+}
+
+/*
+ * Change the terminal attributes and colours to those of a cell. Each change
+ * is keyed by the current and wanted style and the sequence it needed is kept,
+ * so changes seen before can be written again without working them out.
+ */
 void
 tty_attributes(struct tty *tty, const struct grid_cell *gc,
     const struct window_pane *wp)
 {
 	struct grid_cell	*tc = &tty->cell, gc2;
-	u_char			 changed;
+	struct tty_style	*ts;
+	u_int64_t		 from, to;
+	u_int			 idx;
 
 	memcpy(&gc2, gc, sizeof gc2);
 	tty_default_colours(&gc2, wp);
 
-	/*
-	 * If no setab, try to use the reverse attribute as a best-effort for a
-	 * non-default background. This is a bit of a hack but it doesn't do
-	 * any serious harm and makes a couple of applications happier.
-	 */
-	if (!tty_term_has(tty->term, TTYC_SETAB)) {
-		if (gc2.attr & GRID_ATTR_REVERSE) {
-			if (gc2.fg != 7 && gc2.fg != 8)
-				gc2.attr &= ~GRID_ATTR_REVERSE;
-		} else {
-			if (gc2.bg != 0 && gc2.bg != 8)
-				gc2.attr |= GRID_ATTR_REVERSE;
-		}
+	from = tty_style_pack(tc);
+	to = tty_style_pack(&gc2);
+
+	if (tty->styles == NULL)
+		tty->styles = xcalloc(TTY_STYLES, sizeof *tty->styles);
+	idx = ((from * 0x9e3779b97f4a7c15ULL) ^ to) * 0x9e3779b97f4a7c15ULL >> 56;
+	ts = &tty->styles[idx % TTY_STYLES];
+
+	if (ts->valid && ts->from == from && ts->to == to) {
+		tty_puts(tty, ts->data);
+		tty_style_unpack(tc, ts->result);
+		return;
 	}
 
-	/* Fix up the colours if necessary. */
-	tty_check_fg(tty, &gc2);
-	tty_check_bg(tty, &gc2);
+	/* Start from the packed style so the result depends only on the key. */
+	tty_style_unpack(tc, from);
+
+	ts->valid = 0;
+	ts->size = 0;
+	ts->data[0] = '\0';
+
+	tty_style_current = ts;
+	tty_attributes_check(tty, &gc2);
+	tty_attributes_set(tty, &gc2);
+	tty_style_current = NULL;
+
+	ts->result = tty_style_pack(tc);
+	tty_style_unpack(tc, ts->result);
+	if (ts->size < sizeof ts->data) {
+		ts->from = from;
+		ts->to = to;
+		ts->valid = 1;
+	}
+}
+
+/* Write the sequence to change the attributes and colours to a cell. */
+static void
+tty_attributes_set(struct tty *tty, struct grid_cell *gc2)
+{
+	struct grid_cell	*tc = &tty->cell;
+	u_char			 changed;
 
 	/* If any bits are being cleared, reset everything. */
-	if (tc->attr & ~gc2.attr)
+	if (tc->attr & ~gc2->attr)
 		tty_reset(tty);
 
 	/*
 	 * Set the colours. This may call tty_reset() (so it comes next) and
 	 * may add to (NOT remove) the desired attributes by changing new_attr.
 	 */
-	tty_colours(tty, &gc2);
+	tty_colours(tty, gc2);
 
 	/* Filter out attribute bits already set. */
-	changed = gc2.attr & ~tc->attr;
-	tc->attr = gc2.attr;
+	changed = gc2->attr & ~tc->attr;
+	tc->attr = gc2->attr;
 
 	/* Set the attributes. */
 	if (changed & GRID_ATTR_BRIGHT)
@@ -162,6 +162,7 @@ window_copy_init_from_pane(struct window_pane *wp, int scroll_exit)
 		fatalx("not in copy mode");
 
 	data->backing = &wp->base;
+	grid_reflow_finish(data->backing->grid);
 	data->cx = data->backing->cx;
 	data->cy = data->backing->cy;
 	data->scroll_exit = scroll_exit;
@@ -370,6 +371,7 @@ window_copy_resize(struct window_pane *wp, u_int sx, u_int sy)
 	screen_resize(s, sx, sy, 1);
 	if (data->backing != &wp->base)
 		screen_resize(data->backing, sx, sy, 1);
+	grid_reflow_finish(data->backing->grid);
 
 	if (data->cy > sy - 1)
 		data->cy = sy - 1;
@@ -974,8 +976,19 @@ int
 window_copy_search_compare(struct grid *gd, u_int px, u_int py,
     struct grid *sgd, u_int spx, int cis)
 {
-	struct grid_cell	 gc, sgc;
-	const struct utf8_data	*ud, *sud;
+	struct grid_cell		 gc, sgc;
+	const struct grid_cell		*gcp, *sgcp;
+	const struct grid_cell_entry	*gce, *sgce;
+	const struct utf8_data		*ud, *sud;
+
+	/* Compare cells which aren't extended directly. */
+	gce = grid_peek_cell(grid_peek_line(gd, py), px, &gcp);
+	sgce = grid_peek_cell(grid_peek_line(sgd, 0), spx, &sgcp);
+	if (gcp == NULL && sgcp == NULL) {
+		if (cis)
+			return (tolower(gce->data.data) == sgce->data.data);
+		return (gce->data.data == sgce->data.data);
+	}
 
 	grid_get_cell(gd, px, py, &gc);
 	ud = &gc.data;
@@ -1606,7 +1619,9 @@ window_copy_copy_line(struct window_pane *wp, char **buf, size_t *off, u_int sy,
 	struct window_copy_mode_data	*data = wp->modedata;
 	struct grid			*gd = data->backing->grid;
 	struct grid_cell		 gc;
-	struct grid_line		*gl;
+	const struct grid_cell		*gcp;
+	const struct grid_cell_entry	*gce;
+	const struct grid_line		*gl;
 	struct utf8_data		 ud;
 	u_int				 i, xx, wrapped = 0;
 	const char			*s;
@@ -1618,7 +1633,7 @@ window_copy_copy_line(struct window_pane *wp, char **buf, size_t *off, u_int sy,
 	 * Work out if the line was wrapped at the screen edge and all of it is
 	 * on screen.
 	 */
-	gl = &gd->linedata[sy];
+	gl = grid_peek_line(gd, sy);
 	if (gl->flags & GRID_LINE_WRAPPED && gl->cellsize <= gd->sx)
 		wrapped = 1;
 
@@ -1634,7 +1649,18 @@ window_copy_copy_line(struct window_pane *wp, char **buf, size_t *off, u_int sy,
 
 	if (sx < ex) {
 		for (i = sx; i < ex; i++) {
-			grid_get_cell(gd, i, sy, &gc);
+			gce = grid_peek_cell(gl, i, &gcp);
+			if (gcp == NULL) {
+				if (gce->flags & GRID_FLAG_PADDING)
+					continue;
+				if (~gce->data.attr & GRID_ATTR_CHARSET) {
+					*buf = xrealloc(*buf, (*off) + 1);
+					(*buf)[(*off)++] = gce->data.data;
+					continue;
+				}
+				grid_entry_get_cell(gce, &gc);
+			} else
+				memcpy(&gc, gcp, sizeof gc);
 			if (gc.flags & GRID_FLAG_PADDING)
 				continue;
 			utf8_copy(&ud, &gc.data);
@@ -1704,7 +1730,7 @@ window_copy_find_length(struct window_pane *wp, u_int py)
 	 * width of the grid, and screen_write_copy treats them as spaces, so
 	 * ignore them here too.
 	 */
-	px = s->grid->linedata[py].cellsize;
+	px = grid_peek_line(s->grid, py)->cellsize;
 	if (px > screen_size_x(s))
 		px = screen_size_x(s);
 	while (px > 0) {
@@ -1728,7 +1754,7 @@ window_copy_cursor_start_of_line(struct window_pane *wp)
 	if (data->cx == 0 && s->sel.lineflag == LINE_SEL_NONE) {
 		py = screen_hsize(back_s) + data->cy - data->oy;
 		while (py > 0 &&
-		    gd->linedata[py-1].flags & GRID_LINE_WRAPPED) {
+		    grid_peek_line(gd, py - 1)->flags & GRID_LINE_WRAPPED) {
 			window_copy_cursor_up(wp, 0);
 			py = screen_hsize(back_s) + data->cy - data->oy;
 		}
@@ -1776,9 +1802,9 @@ window_copy_cursor_end_of_line(struct window_pane *wp)
 	if (data->cx == px && s->sel.lineflag == LINE_SEL_NONE) {
 		if (data->screen.sel.flag && data->rectflag)
 			px = screen_size_x(back_s);
-		if (gd->linedata[py].flags & GRID_LINE_WRAPPED) {
+		if (grid_peek_line(gd, py)->flags & GRID_LINE_WRAPPED) {
 			while (py < gd->sy + gd->hsize &&
-			    gd->linedata[py].flags & GRID_LINE_WRAPPED) {
+			    grid_peek_line(gd, py)->flags & GRID_LINE_WRAPPED) {
 				window_copy_cursor_down(wp, 0);
 				py = screen_hsize(back_s)
 				     + data->cy - data->oy;
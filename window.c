@@ -61,6 +61,9 @@ u_int	next_active_point;
 
 void	window_pane_timer_callback(int, short, void *);
 void	window_pane_read_callback(struct bufferevent *, void *);
+void	window_pane_read_adjust(struct window_pane *, size_t);
+void	window_pane_frame_check(struct window_pane *, size_t);
+void	window_pane_frame_callback(int, short, void *);
 void	window_pane_error_callback(struct bufferevent *, short, void *);
 
 struct window_pane *window_pane_choose_best(struct window_pane **, u_int);
@@ -295,6 +298,7 @@ window_create1(u_int sx, u_int sy)
 	w->flags = 0;
 
 	TAILQ_INIT(&w->panes);
+	TAILQ_INIT(&w->viewers);
 	w->active = NULL;
 
 #ifdef TMATE
@@ -350,8 +354,15 @@ window_create(const char *name, int argc, char **argv, const char *path,
 void
 window_destroy(struct window *w)
 {
+	struct client	*c;
+
 	RB_REMOVE(windows, &windows, w);
 
+	while ((c = TAILQ_FIRST(&w->viewers)) != NULL) {
+		TAILQ_REMOVE(&w->viewers, c, wentry);
+		c->window = NULL;
+	}
+
 	if (w->layout_root != NULL)
 		layout_free_cell(w->layout_root);
 	if (w->saved_layout_root != NULL)
@@ -368,6 +379,9 @@ window_destroy(struct window *w)
 
 	window_destroy_panes(w);
 
+	free(w->cells);
+	free(w->cellpanes);
+
 	free(w->name);
 	free(w);
 }
@@ -468,18 +482,10 @@ window_redraw_active_switch(struct window *w, struct window_pane *wp)
 struct window_pane *
 window_get_active_at(struct window *w, u_int x, u_int y)
 {
-	struct window_pane	*wp;
-
-	TAILQ_FOREACH(wp, &w->panes, entry) {
-		if (!window_pane_visible(wp))
-			continue;
-		if (x < wp->xoff || x > wp->xoff + wp->sx)
-			continue;
-		if (y < wp->yoff || y > wp->yoff + wp->sy)
-			continue;
-		return (wp);
-	}
-	return (NULL);
+	screen_redraw_update_cells(w);
+	if (x >= w->cellsx || y >= w->cellsy)
+		return (NULL);
+	return (w->cells[y * w->cellsx + x].at);
 }
 
 struct window_pane *
@@ -785,6 +791,8 @@ window_pane_create(struct window *w, u_int sx, u_int sy, u_int hlimit)
 
 	screen_init(&wp->base, sx, sy, hlimit);
 	wp->screen = &wp->base;
+	if (options_get_number(w->options, "history-on-disk"))
+		wp->base.grid->flags |= GRID_HISTORY_FILE;
 
 	if (gethostname(host, sizeof host) == 0)
 		screen_set_title(&wp->base, host);
@@ -801,6 +809,12 @@ window_pane_destroy(struct window_pane *wp)
 
 	if (event_initialized(&wp->timer))
 		evtimer_del(&wp->timer);
+	if (event_initialized(&wp->frame_timer))
+		evtimer_del(&wp->frame_timer);
+
+#ifdef TMATE
+	tmate_pty_data_free(wp);
+#endif
 
 	if (wp->fd != -1) {
 #ifdef HAVE_UTEMPTER
@@ -812,9 +826,10 @@ window_pane_destroy(struct window_pane *wp)
 
 	input_free(wp);
 
-	screen_free(&wp->base);
+	/* The saved grid holds lines from the base grid, so free it first. */
 	if (wp->saved_grid != NULL)
 		grid_destroy(wp->saved_grid);
+	screen_free(&wp->base);
 
 	if (wp->pipe_fd != -1) {
 		bufferevent_free(wp->pipe_event);
@@ -946,7 +961,11 @@ window_pane_spawn(struct window_pane *wp, int argc, char **argv,
 	wp->event = bufferevent_new(wp->fd, window_pane_read_callback, NULL,
 	    window_pane_error_callback, wp);
 
-	bufferevent_setwatermark(wp->event, EV_READ, 0, READ_SIZE);
+	wp->read_size = READ_SIZE;
+	wp->read_bytes = wp->read_rate = 0;
+	gettimeofday(&wp->read_time, NULL);
+
+	bufferevent_setwatermark(wp->event, EV_READ, 0, wp->read_size);
 	bufferevent_enable(wp->event, EV_READ|EV_WRITE);
 
 	free(cmd);
@@ -959,6 +978,116 @@ window_pane_timer_callback(__unused int fd, __unused short events, void *data)
 	window_pane_read_callback(NULL, data);
 }
 
+/*
+ * Adjust the pty read size after reading some data. A pane that fills the
+ * buffer is producing output faster than it is parsed, so let it read more at
+ * once; one that only reads a little is probably interactive.
+ */
+void
+window_pane_read_adjust(struct window_pane *wp, size_t size)
+{
+	size_t	old_size = wp->read_size;
+
+	if (size >= wp->read_size && wp->read_size < READ_SIZE_MAX)
+		wp->read_size *= 2;
+	else if (size < wp->read_size / 4 && wp->read_size > READ_SIZE)
+		wp->read_size /= 2;
+	if (wp->read_size != old_size) {
+		log_debug("%%%u read size %zu", wp->id, wp->read_size);
+		bufferevent_setwatermark(wp->event, EV_READ, 0, wp->read_size);
+	}
+
+	wp->read_bytes += size;
+	window_pane_read_rate(wp);
+}
+
+/* Get the pty read rate in bytes per second, starting a new interval if due. */
+size_t
+window_pane_read_rate(struct window_pane *wp)
+{
+	struct timeval		now, tv;
+	unsigned long long	elapsed;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &wp->read_time, &tv);
+	elapsed = tv.tv_sec * 1000000ULL + tv.tv_usec;
+	if (elapsed >= READ_RATE_TIME) {
+		wp->read_rate = wp->read_bytes * 1000000ULL / elapsed;
+		wp->read_bytes = 0;
+		memcpy(&wp->read_time, &now, sizeof wp->read_time);
+	}
+	return (wp->read_rate);
+}
+
+/* Start the frame timer for a pane. */
+static void
+window_pane_frame_start(struct window_pane *wp, u_int rate)
+{
+	struct timeval	tv;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 1000000 / rate;
+
+	evtimer_set(&wp->frame_timer, window_pane_frame_callback, wp);
+	evtimer_add(&wp->frame_timer, &tv);
+}
+
+/*
+ * Count output for the current frame. If there is too much, stop sending the
+ * pane's changes to clients and redraw it once a frame instead.
+ */
+void
+window_pane_frame_check(struct window_pane *wp, size_t size)
+{
+	struct timeval	now, tv;
+	u_int		rate;
+
+	if (wp->flags & PANE_FRAMED) {
+		wp->frame_bytes += size;
+		return;
+	}
+
+	rate = options_get_number(wp->window->options, "frame-rate");
+	if (rate == 0)
+		return;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &wp->frame_time, &tv);
+	if (tv.tv_sec != 0 || tv.tv_usec >= 1000000 / rate) {
+		memcpy(&wp->frame_time, &now, sizeof wp->frame_time);
+		wp->frame_bytes = 0;
+	}
+	wp->frame_bytes += size;
+	if (wp->frame_bytes < FRAME_SIZE)
+		return;
+
+	log_debug("%%%u flooding, redrawing %u times a second", wp->id, rate);
+	wp->flags |= PANE_FRAMED;
+	wp->frame_bytes = 0;
+	window_pane_frame_start(wp, rate);
+}
+
+/* Frame timer: redraw the pane and stop if the output has slowed down. */
+void
+window_pane_frame_callback(__unused int fd, __unused short events, void *data)
+{
+	struct window_pane	*wp = data;
+	u_int			 rate;
+
+	wp->flags |= PANE_REDRAW;
+
+	rate = options_get_number(wp->window->options, "frame-rate");
+	if (rate != 0 && wp->frame_bytes >= FRAME_SIZE / 4) {
+		wp->frame_bytes = 0;
+		window_pane_frame_start(wp, rate);
+		return;
+	}
+
+	log_debug("%%%u no longer flooding", wp->id);
+	wp->flags &= ~PANE_FRAMED;
+	wp->frame_bytes = 0;
+}
+
 void
 window_pane_read_callback(__unused struct bufferevent *bufev, void *data)
 {
@@ -974,7 +1103,7 @@ window_pane_read_callback(__unused struct bufferevent *bufev, void *data)
 
 	log_debug("%%%u has %zu bytes", wp->id, EVBUFFER_LENGTH(evb));
 
-	TAILQ_FOREACH(c, &clients, entry) {
+	TAILQ_FOREACH(c, &wp->window->viewers, wentry) {
 		if (!tty_client_ready(c, wp))
 			continue;
 
@@ -996,6 +1125,8 @@ window_pane_read_callback(__unused struct bufferevent *bufev, void *data)
 		tmate_pty_data(wp, new_data, new_size);
 #endif
 
+	window_pane_read_adjust(wp, EVBUFFER_LENGTH(evb));
+	window_pane_frame_check(wp, EVBUFFER_LENGTH(evb));
 	input_parse(wp);
 
 	wp->pipe_off = EVBUFFER_LENGTH(evb);
@@ -1057,16 +1188,18 @@ window_pane_alternate_on(struct window_pane *wp, struct grid_cell *gc,
 	sx = screen_size_x(s);
 	sy = screen_size_y(s);
 
+	/*
+	 * Swap the visible lines with the empty lines of the saved grid, this
+	 * also clears the screen.
+	 */
 	wp->saved_grid = grid_create(sx, sy, 0);
-	grid_duplicate_lines(wp->saved_grid, 0, s->grid, screen_hsize(s), sy);
+	grid_swap_lines(wp->saved_grid, 0, s->grid, screen_hsize(s), sy);
 	if (cursor) {
 		wp->saved_cx = s->cx;
 		wp->saved_cy = s->cy;
 	}
 	memcpy(&wp->saved_cell, gc, sizeof wp->saved_cell);
 
-	grid_view_clear(s->grid, 0, 0, sx, sy);
-
 	wp->base.grid->flags &= ~GRID_HISTORY;
 
 	wp->flags |= PANE_REDRAW;
@@ -1095,7 +1228,8 @@ window_pane_alternate_off(struct window_pane *wp, struct grid_cell *gc,
 		screen_resize(s, sx, wp->saved_grid->sy, 1);
 
 	/* Restore the grid, cursor position and cell. */
-	grid_duplicate_lines(s->grid, screen_hsize(s), wp->saved_grid, 0, sy);
+	grid_clear_lines(s->grid, screen_hsize(s), sy);
+	grid_swap_lines(s->grid, screen_hsize(s), wp->saved_grid, 0, sy);
 	if (cursor)
 		s->cx = wp->saved_cx;
 	if (s->cx > screen_size_x(s) - 1)
@@ -1175,6 +1309,10 @@ window_pane_key(struct window_pane *wp, struct client *c, struct session *s,
 		return;
 
 	input_key(wp, key, m);
+#ifdef TMATE
+	/* The output that follows is likely an echo, don't hold it back */
+	wp->tmate_echo = 1;
+#endif
 
 	if (KEYC_IS_MOUSE(key))
 		return;